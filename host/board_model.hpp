@@ -0,0 +1,98 @@
+/*
+  Cost model of the boards for the host tools (gmv_sim and gmv_mux)
+  The decoding cost is computed from the counters of TJpgD, the tools are built with JD_COSTCOUNT.
+  The values are rough, from "320x240 about 24 FPS, 320x180 about 30 FPS" with 7KB JPEG (See README).
+  Calibrate them with the telemetry build (read, decode and dma of the log).
+*/
+#ifndef HOST_BOARD_MODEL_HPP
+#define HOST_BOARD_MODEL_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include "../src/tjpgdClass.h"
+
+#if !JD_COSTCOUNT
+#error "board_model.hpp needs TJpgD::cost (JD_COSTCOUNT=1)"
+#endif
+
+// Cost parameters of the board (us unless noted)
+struct Board
+{
+    const char* name;
+    double sdBytesPerUs;  // SD read throughput
+    double sdOverheadUs;  // Per block (Command and seek)
+    double lcdBytesPerUs; // SPI write throughput of the LCD
+    double dmaSetupUs;    // Per pushImageDMA
+    // Core 1 is Huffman, de-quantize and IDCT (ns)
+    double symbolNs;      // Per Huffman symbol (DC, AC and EOB)
+    double nonzeroNs;     // Per non-zero AC element
+    double idct8Ns;       // Per block of block_idct<8>
+    double idct4Ns;       // Per block of block_idct<4>
+    double dcNs;          // Per block of DC only
+    // Core 0 is the color conversion and the write to the band (ns)
+    double pixelNs;       // Per output pixel
+    double prepareUs;     // TJpgD::prepare
+    double loopUs;        // The rest of the loop (Buttons, log)
+};
+
+const Board boards[] =
+{
+    { "basic",  2.0, 250.0, 4.4, 30.0, 300.0, 120.0, 3600.0, 2400.0, 800.0, 50.0, 400.0, 300.0 }, // Basic, Gray, Fire
+    { "core2",  2.0, 250.0, 4.4, 30.0, 300.0, 120.0, 3600.0, 2400.0, 800.0, 50.0, 400.0, 300.0 },
+    { "cores3", 2.0, 250.0, 4.4, 30.0, 250.0, 100.0, 2900.0, 1900.0, 650.0, 40.0, 350.0, 250.0 },
+};
+
+// Names of -p name=value
+const struct { const char* name; double Board::* member; } boardParams[] =
+{
+    { "sd_bytes_per_us", &Board::sdBytesPerUs }, { "sd_overhead_us", &Board::sdOverheadUs },
+    { "lcd_bytes_per_us", &Board::lcdBytesPerUs }, { "dma_setup_us", &Board::dmaSetupUs },
+    { "symbol_ns", &Board::symbolNs }, { "nonzero_ns", &Board::nonzeroNs },
+    { "idct8_ns", &Board::idct8Ns }, { "idct4_ns", &Board::idct4Ns }, { "dc_ns", &Board::dcNs },
+    { "pixel_ns", &Board::pixelNs }, { "prepare_us", &Board::prepareUs }, { "loop_us", &Board::loopUs },
+};
+
+//! @brief Board of the name, nullptr if not found
+inline const Board* findBoard(const char* name)
+{
+    auto it = std::find_if(std::begin(boards), std::end(boards), [&](const Board& b) { return !strcmp(name, b.name); });
+    return it != std::end(boards) ? &*it : nullptr;
+}
+
+//! @brief Set the parameter by "name=value", false if the name is unknown
+inline bool setBoardParam(Board& board, const std::string& kv)
+{
+    auto eq = kv.find('=');
+    if(eq == std::string::npos) { return false; }
+    for(auto& p : boardParams)
+    {
+        if(kv.compare(0, eq, p.name) == 0 && strlen(p.name) == eq)
+        {
+            board.*(p.member) = atof(kv.c_str() + eq + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Counters of a decomp (TJpgD::cost)
+using DecodeCount = decltype(TJpgDSession::cost);
+
+// Time of core 1 (us) by the counters
+inline double core1Us(const Board& b, const DecodeCount& c)
+{
+    return (c.symbols * b.symbolNs + c.nonzero * b.nonzeroNs
+            + c.idct8 * b.idct8Ns + c.idct4 * b.idct4Ns + (c.blocks - c.idct8 - c.idct4) * b.dcNs) / 1000.0;
+}
+// Time of core 0 (us) for the output pixels
+inline double core0Us(const Board& b, const uint64_t pixels) { return pixels * b.pixelNs / 1000.0; }
+
+//! @brief Decoding time (us) of decomp_multitask, the cores run in parallel
+inline double decodeUs(const Board& b, const DecodeCount& c, const uint64_t pixels)
+{
+    return b.prepareUs + std::max(core1Us(b, c), core0Us(b, pixels));
+}
+#endif
@@ -0,0 +1,727 @@
+/*
+  gmv_mux
+  Make GMV from the MJPEG stream of stdin and the wav file in one pass.
+  Oversized frames are re-encoded at the highest quality that fits on the worker threads, and the frames in flight are limited,
+  so the memory does not depend on the length of the movie.
+  A frame over the size even at -q is lowered to quality 1, and it fails if any frame is still over the size.
+  With -b, the quality is lowered on the runs of large frames to keep the sustained read rate of the SD. (RateWindow)
+  With -c, each frame is decoded by TJpgD with the cost counter, and the decoding time on the board is predicted. (board_model.hpp)
+  Frames over the decoding budget are re-encoded at the highest quality that fits, in 4:2:0 if the budget limits the source sampling.
+
+  ffmpeg -i movie.mp4 -vf scale=320:-1,dejudder,framerate=30 -qmin 1 -q:v 1 -f mjpeg - | gmv_mux movie.wav 30 movie.gmv
+  gmv_mux [-s jpeg_maximum_size] [-q minimum_quality] [-b bytes_per_sec] [-w window_sec] [-c board] [-p name=value]... [-t decode_us]
+          [-r restart_interval] [-j threads] [--noindex] [-v] wav_path fps output_path
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <csetjmp>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <jpeglib.h>
+#include "../src/gob_gmv.hpp"
+#include "board_model.hpp" // Built with JD_COSTCOUNT
+
+namespace
+{
+// JPEG stream of stdin
+class MJPEGReader
+{
+  public:
+    explicit MJPEGReader(FILE* fp) : _fp(fp) {}
+
+    // Next JPEG (SOI to EOI)
+    bool next(std::vector<uint8_t>& out)
+    {
+        out.clear();
+        // Skip to SOI
+        int c, prev = 0;
+        while((c = get()) != EOF)
+        {
+            if(prev == 0xFF && c == 0xD8) { break; }
+            prev = c;
+        }
+        if(c == EOF) { return false; }
+        out.push_back(0xFF);
+        out.push_back(0xD8);
+
+        for(;;)
+        {
+            // Marker (Fill bytes 0xFF are skipped)
+            if((c = get()) != 0xFF) { return false; }
+            while((c = get()) == 0xFF) { ; }
+            if(c == EOF) { return false; }
+            out.push_back(0xFF);
+            out.push_back(c);
+            if(c == 0xD9) { return true; }                          // EOI
+            if(c == 0x01 || (c >= 0xD0 && c <= 0xD7)) { continue; } // No length
+            // Segment
+            int hi = get(), lo = get();
+            if(lo == EOF) { return false; }
+            uint32_t len = (hi << 8) | lo;
+            if(len < 2) { return false; }
+            out.push_back(hi);
+            out.push_back(lo);
+            size_t pos = out.size();
+            out.resize(pos + len - 2);
+            if(read(&out[pos], len - 2) != len - 2) { return false; }
+            if(c != 0xDA) { continue; }
+            // Entropy-coded data to the next marker (0xFF00 and RSTn are the data)
+            for(;;)
+            {
+                if((c = get()) == EOF) { return false; }
+                if(c != 0xFF) { out.push_back(c); continue; }
+                int n = get();
+                while(n == 0xFF) { n = get(); }
+                if(n == EOF) { return false; }
+                if(n == 0x00 || (n >= 0xD0 && n <= 0xD7)) { out.push_back(0xFF); out.push_back(n); continue; }
+                unget(n);
+                unget(0xFF);
+                break;
+            }
+        }
+    }
+
+  private:
+    int get()
+    {
+        if(!_back.empty()) { int c = _back.back(); _back.pop_back(); return c; }
+        return getc(_fp);
+    }
+    void unget(const int c) { _back.push_back(c); }
+    size_t read(uint8_t* buf, const size_t len)
+    {
+        size_t n{};
+        while(n < len && !_back.empty()) { buf[n++] = get(); }
+        return n + fread(buf + n, 1, len - n, _fp);
+    }
+
+    FILE* _fp{};
+    std::vector<int> _back{};
+};
+
+// PCM of the wav file is read for each block
+class WavReader
+{
+  public:
+    ~WavReader() { if(_fp) { fclose(_fp); } }
+
+    bool open(const char* path)
+    {
+        if(!(_fp = fopen(path, "rb"))) { return false; }
+        if(fread(&_header, sizeof(_header), 1, _fp) != 1 ||
+           memcmp(_header.RIFF, "RIFF", 4) || memcmp(_header.WAVEfmt, "WAVEfmt ", 8))
+        {
+            return false;
+        }
+        if(_header.fmt_chunk_size > 16) { fseek(_fp, _header.fmt_chunk_size - 16, SEEK_CUR); }
+        gob::sub_chunk_t sub{};
+        while(fread(&sub, 8, 1, _fp) == 1)
+        {
+            if(!memcmp(sub.identifier, "data", 4)) { _rest = sub.chunk_size; return true; }
+            fseek(_fp, sub.chunk_size, SEEK_CUR);
+        }
+        return false;
+    }
+    const gob::wav_header_t& header() const { return _header; }
+
+    uint32_t read(std::vector<uint8_t>& out, uint32_t len)
+    {
+        len = std::min(len, _rest);
+        out.resize(len);
+        len = fread(out.data(), 1, len, _fp);
+        out.resize(len);
+        _rest -= len;
+        return len;
+    }
+
+  private:
+    FILE* _fp{};
+    gob::wav_header_t _header{};
+    uint32_t _rest{};
+};
+
+// Error of libjpeg returns to the caller instead of exit
+struct ErrorManager
+{
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+    static void exit(j_common_ptr cinfo) { longjmp(((ErrorManager*)cinfo->err)->jump, 1); }
+    static void output(j_common_ptr) {}
+    jpeg_error_mgr* init()
+    {
+        jpeg_std_error(&pub);
+        pub.error_exit = exit;
+        pub.output_message = output;
+        return &pub;
+    }
+};
+
+// Decoded image in the color space of JPEG
+struct Image
+{
+    uint32_t width{}, height{};
+    int components{};
+    J_COLOR_SPACE space{};
+    int hsamp{}, vsamp{}; // Sampling factor of the luminance
+    std::vector<uint8_t> pixels;
+};
+
+bool decode(const std::vector<uint8_t>& in, Image& img)
+{
+    jpeg_decompress_struct cinfo{};
+    ErrorManager err;
+    cinfo.err = err.init();
+    if(setjmp(err.jump)) { jpeg_destroy_decompress(&cinfo); return false; }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, in.data(), in.size());
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = cinfo.jpeg_color_space == JCS_GRAYSCALE ? JCS_GRAYSCALE : JCS_YCbCr; // Without the color conversion
+    img.hsamp = cinfo.comp_info[0].h_samp_factor;
+    img.vsamp = cinfo.comp_info[0].v_samp_factor;
+    jpeg_start_decompress(&cinfo);
+    img.width = cinfo.output_width;
+    img.height = cinfo.output_height;
+    img.components = cinfo.output_components;
+    img.space = cinfo.out_color_space;
+    img.pixels.resize((size_t)img.width * img.height * img.components);
+    while(cinfo.output_scanline < cinfo.output_height)
+    {
+        JSAMPROW row = &img.pixels[(size_t)cinfo.output_scanline * img.width * img.components];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+// Baseline JPEG with the optimized Huffman tables (samp: Sampling factor of the luminance, 0 is the same as the source)
+bool encode(const Image& img, const int quality, const uint32_t restart, std::vector<uint8_t>& out, const int samp = 0)
+{
+    jpeg_compress_struct cinfo{};
+    ErrorManager err;
+    unsigned char* buf{};
+    unsigned long size{};
+    cinfo.err = err.init();
+    if(setjmp(err.jump)) { jpeg_destroy_compress(&cinfo); free(buf); return false; }
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &buf, &size);
+    cinfo.image_width = img.width;
+    cinfo.image_height = img.height;
+    cinfo.input_components = img.components;
+    cinfo.in_color_space = img.space;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.comp_info[0].h_samp_factor = samp ? samp : img.hsamp;
+    cinfo.comp_info[0].v_samp_factor = samp ? samp : img.vsamp;
+    cinfo.optimize_coding = TRUE;
+    cinfo.restart_interval = restart;
+    jpeg_start_compress(&cinfo, TRUE);
+    while(cinfo.next_scanline < cinfo.image_height)
+    {
+        JSAMPROW row = const_cast<JSAMPROW>(&img.pixels[(size_t)cinfo.next_scanline * img.width * img.components]);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    out.assign(buf, buf + size);
+    free(buf);
+    return true;
+}
+
+// Insert the restart markers without loss (Same as jpegtran -optimize -restart NB)
+bool addRestart(std::vector<uint8_t>& data, const uint32_t interval)
+{
+    jpeg_decompress_struct src{};
+    jpeg_compress_struct dst{};
+    ErrorManager serr, derr;
+    unsigned char* buf{};
+    unsigned long size{};
+    src.err = serr.init();
+    dst.err = derr.init();
+    if(setjmp(serr.jump) || setjmp(derr.jump))
+    {
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        free(buf);
+        return false;
+    }
+    jpeg_create_decompress(&src);
+    jpeg_create_compress(&dst);
+    jpeg_mem_src(&src, data.data(), data.size());
+    jpeg_read_header(&src, TRUE);
+    auto coef = jpeg_read_coefficients(&src);
+    jpeg_copy_critical_parameters(&src, &dst);
+    dst.optimize_coding = TRUE;
+    dst.restart_interval = interval;
+    jpeg_mem_dest(&dst, &buf, &size);
+    jpeg_write_coefficients(&dst, coef);
+    jpeg_finish_compress(&dst);
+    jpeg_finish_decompress(&src);
+    jpeg_destroy_compress(&dst);
+    jpeg_destroy_decompress(&src);
+    data.assign(buf, buf + size);
+    free(buf);
+    return true;
+}
+
+uint32_t nullOutput(TJpgD*, void*, TJpgD::JRECT*) { return 1; }
+
+//! @brief Predicted decoding time (us) of the JPEG, negative if TJpgD can not decode it
+double decodeUs(const Board& board, const std::vector<uint8_t>& data)
+{
+    TJpgD jd{};
+    jd.format = TJpgD::JDF_SWAP565;
+    if(jd.prepare(data.data(), data.size(), nullptr) != TJpgD::JDR_OK || jd.decomp(nullOutput) != TJpgD::JDR_OK) { return -1.0; }
+    return ::decodeUs(board, jd.cost, (uint64_t)jd.width * jd.height);
+}
+
+struct Options
+{
+    uint32_t maxSize{7168};
+    int minQuality{10};
+    uint32_t restart{};
+    uint32_t rate{};     // Sustained read rate (bytes/s, 0: unlimited)
+    float window{1.0f};  // Burst of the rate (sec)
+    const Board* device{}; // Decoding cost model (nullptr: not used)
+    Board custom{};
+    double decodeUs{};   // Decoding budget of a frame (us)
+    uint32_t threads{};
+    bool index{true};
+    bool verbose{};
+};
+
+// Frame in flight
+struct Job
+{
+    uint32_t frame{};
+    std::vector<uint8_t> jpeg;
+    int quality{}; // Re-encoded quality (0: as it is)
+    int samp{};    // Sampling factor of the re-encoding (0: as the source)
+    double us{};   // Predicted decoding time
+    Image source;  // Decoded if re-encoded (Source of the re-encoding by the rate)
+    bool taken{}, done{};
+};
+
+// Frame fits the size and the decoding budget
+bool fits(const std::vector<uint8_t>& jpeg, const uint32_t size, const Options& opt, bool* overBudget = nullptr)
+{
+    bool decodable = !opt.device || decodeUs(*opt.device, jpeg) <= opt.decodeUs;
+    if(overBudget && !decodable) { *overBudget = true; }
+    return jpeg.size() <= size && decodable;
+}
+
+/*
+  Largest encoding within the budget by the binary search of the quality
+  Size and the decoding cost are nearly monotonic in the quality. Returns the quality, negative if nothing fits (encoded at qmin).
+  overBudget is set if a tried quality is over the decoding budget.
+ */
+int fitQuality(const Image& img, const int samp, const uint32_t size, const Options& opt, std::vector<uint8_t>& out, bool& overBudget)
+{
+    std::vector<uint8_t> tmp;
+    int lo = opt.minQuality, hi = 100, best{};
+    overBudget = false;
+    while(lo <= hi)
+    {
+        int q = (lo + hi) / 2;
+        if(!encode(img, q, opt.restart, tmp, samp)) { return 0; }
+        if(fits(tmp, size, opt, &overBudget)) { out.swap(tmp); best = q; lo = q + 1; }
+        else { hi = q - 1; }
+    }
+    if(best) { return best; }
+    return encode(img, opt.minQuality, opt.restart, out, samp) ? -opt.minQuality : 0; // Nothing fits
+}
+
+// Sum of the squared errors to the source (Both are decoded in the color space of JPEG at full resolution)
+double distortion(const Image& src, const std::vector<uint8_t>& jpeg)
+{
+    Image img;
+    if(!decode(jpeg, img) || img.pixels.size() != src.pixels.size()) { return std::numeric_limits<double>::infinity(); }
+    double sse{};
+    for(size_t i = 0; i < img.pixels.size(); ++i)
+    {
+        double d = (int)img.pixels[i] - (int)src.pixels[i];
+        sse += d * d;
+    }
+    return sse;
+}
+
+/*
+  Re-encode in the source sampling, and in 4:2:0 if the decoding budget limits the source sampling
+  4:2:0 halves the chroma blocks to decode. If both fit, the one closer to the source wins.
+ */
+int reencode(Job& job, const uint32_t size, const Options& opt)
+{
+    const auto& img = job.source;
+    std::vector<uint8_t> out;
+    bool overBudget{};
+    int q = fitQuality(img, job.samp, size, opt, out, overBudget);
+    if(overBudget && !job.samp && img.components == 3 && (img.hsamp != 2 || img.vsamp != 2))
+    {
+        std::vector<uint8_t> out420;
+        int q420 = fitQuality(img, 2, size, opt, out420, overBudget);
+        bool better = q420 && (q <= 0 ? (q420 > 0 || decodeUs(*opt.device, out420) < decodeUs(*opt.device, out))
+                                      : q420 > 0 && distortion(img, out420) < distortion(img, out));
+        if(better) { out.swap(out420); q = q420; job.samp = 2; }
+    }
+    if(!q) { return 0; }
+    job.jpeg.swap(out);
+    job.quality = std::abs(q);
+    return q;
+}
+
+// Frames oversized or over the decoding budget are re-encoded at the highest quality that fits
+void process(Job& job, const Options& opt)
+{
+    if(opt.restart && !addRestart(job.jpeg, opt.restart))
+    {
+        fprintf(stderr, "Failed to add restart markers %u\n", job.frame);
+    }
+    if(!fits(job.jpeg, opt.maxSize, opt))
+    {
+        if(!decode(job.jpeg, job.source)) { fprintf(stderr, "Failed to decode %u\n", job.frame); return; }
+        int q = reencode(job, opt.maxSize, opt);
+        if(!q) { fprintf(stderr, "Failed to encode %u\n", job.frame); }
+        else if(q < 0 && job.jpeg.size() > opt.maxSize)
+        {
+            // The device truncates the block over the buffer, the quality goes below -q for the size
+            Options sizeOnly = opt;
+            sizeOnly.minQuality = 1;
+            sizeOnly.device = nullptr;
+            std::vector<uint8_t> out;
+            bool overBudget{};
+            int lower = fitQuality(job.source, job.samp, opt.maxSize, sizeOnly, out, overBudget);
+            if(lower) { job.jpeg.swap(out); job.quality = std::abs(lower); }
+            fprintf(stderr, "Frame %u does not fit %u at quality %d, %s\n", job.frame, opt.maxSize, -q,
+                    lower > 0 ? ("lowered to " + std::to_string(lower)).c_str() : "not even at 1");
+        }
+        else if(q < 0) { fprintf(stderr, "Frame %u does not fit %zu at quality %d\n", job.frame, job.jpeg.size(), -q); }
+    }
+    if(opt.device) { job.us = decodeUs(*opt.device, job.jpeg); }
+}
+
+/*
+  Sustained read rate over the sliding window (Leaky bucket that leaks the blocks leaving the window)
+  Blocks (header, image and wav) in any window must be less than or equal to rate * window.
+  The prefetcher reads a few blocks ahead, so the card is stressed by the sustained stream, not by a frame.
+ */
+class RateWindow
+{
+  public:
+    RateWindow(const uint32_t rate, const float window, const float fps)
+            : _limit((double)rate * window), _fps(fps), _frames(std::max(1, (int)std::lround(window * fps))) {}
+
+    bool enabled() const { return _limit > 0.0; }
+    uint32_t lookahead() const { return _frames; }
+
+    /*
+      Allowed size of the image of the first frame
+      @param ahead Sizes of the image and the rest of the block in the lookahead
+      @note Images are reduced at the same ratio in the tightest window that ends in the lookahead,
+      so the quality falls over the run of large frames instead of the last ones.
+     */
+    uint32_t budget(const std::vector<std::pair<uint32_t, uint32_t> >& ahead) const
+    {
+        double scale = 1.0, image{}, rest{};
+        for(size_t i = 0; i < ahead.size() && i < _frames; ++i)
+        {
+            image += ahead[i].first;
+            rest += ahead[i].second;
+            if(image > 0.0) { scale = std::min(scale, (_limit - tail(_frames - 1 - i) - rest) / image); }
+        }
+        double b = std::min(ahead[0].first * std::max(scale, 0.0), _limit - tail(_frames - 1) - ahead[0].second);
+        return b > 0.0 ? (uint32_t)b : 0;
+    }
+
+    void push(const uint32_t bytes)
+    {
+        _recent.push_back(bytes);
+        if(_recent.size() > _frames) { _recent.pop_front(); }
+        double sum = tail(_frames);
+        if(sum > _limit) { ++_overflows; }
+        if(_recent.size() == _frames) { _peak = std::max(_peak, sum * _fps / _frames); }
+    }
+    uint32_t overflows() const { return _overflows; }
+    //! @brief Largest bytes/s over the window
+    uint32_t peak() const { return (uint32_t)_peak; }
+
+  private:
+    // Sum of the last n blocks
+    double tail(size_t n) const
+    {
+        n = std::min(n, _recent.size());
+        return std::accumulate(_recent.end() - n, _recent.end(), 0.0);
+    }
+
+    double _limit{}, _fps{}, _peak{};
+    uint32_t _frames{}, _overflows{};
+    std::deque<uint32_t> _recent;
+};
+
+class Muxer
+{
+  public:
+    Muxer(const Options& opt, WavReader& wav, const float fps)
+            : _opt(opt), _wav(wav), _fps(fps), _rate(opt.rate, opt.window, fps)
+    {
+        // Same as gmv.py
+        auto& wh = wav.header();
+        double integral{};
+        _wblk = (uint32_t)(wh.byte_per_sec / fps) & ~(uint32_t)(std::max<uint16_t>(wh.block_size, 1) - 1);
+        _wadd = wh.block_size;
+        _frac = std::modf(wh.sample_rate / fps, &integral);
+    }
+
+    bool run(FILE* in, const char* path)
+    {
+        if(!(_out = fopen(path, "wb"))) { fprintf(stderr, "Failed to open %s\n", path); return false; }
+
+        // Header is rewritten at the end
+        gob::GMVHeader header{};
+        gob::GMVIndex index{};
+        header.signature = _opt.index ? gob::GMVHeader::SignatureWithIndex : gob::GMVHeader::Signature;
+        header.gcfOffset = sizeof(header) + (_opt.index ? sizeof(index) : 0);
+        header.fps = _fps;
+        header.wavHeader = _wav.header();
+        fwrite(&header, sizeof(header), 1, _out);
+        if(_opt.index) { fwrite(&index, sizeof(index), 1, _out); }
+
+        std::vector<std::thread> workers;
+        for(uint32_t i = 0; i < _opt.threads; ++i) { workers.emplace_back(&Muxer::worker, this); }
+        std::thread writer(&Muxer::writer, this);
+
+        // Read the stream while the frames in flight are less than the window
+        MJPEGReader reader(in);
+        const size_t window = std::max<size_t>(_opt.threads * 4, _rate.enabled() ? _rate.lookahead() + 1 : 0);
+        for(uint32_t frame = 0;; ++frame)
+        {
+            auto job = std::make_shared<Job>();
+            job->frame = frame;
+            if(!reader.next(job->jpeg)) { break; }
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [&] { return _jobs.size() < window; });
+            _jobs.push_back(job);
+            _cv.notify_all();
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _eof = true;
+            _cv.notify_all();
+        }
+        for(auto& t : workers) { t.join(); }
+        writer.join();
+
+        // Terminator, index and the header
+        gob::GMVBlock term{ { gob::GMVBlock::Terminator, gob::GMVBlock::Terminator } };
+        fwrite(&term, sizeof(term), 1, _out);
+        if(_opt.index)
+        {
+            index.offset = ftell(_out);
+            fwrite(_offsets.data(), sizeof(uint32_t), _offsets.size(), _out);
+        }
+        header.blocks = _offsets.size();
+        fseek(_out, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, _out);
+        if(_opt.index) { fwrite(&index, sizeof(index), 1, _out); }
+        bool ok = !ferror(_out);
+        fclose(_out);
+        fprintf(stderr, "%s blocks:%zu re-encoded:%u quality:%u fill:%u%%\n", path, _offsets.size(), _reencoded,
+                _reencoded ? _qualities / _reencoded : 0, _offsets.empty() ? 0 : (uint32_t)(_imageBytes * 100 / (_offsets.size() * _opt.maxSize)));
+        if(_rate.enabled())
+        {
+            fprintf(stderr, "rate:%u B/s window:%.1fs limited:%u peak:%u B/s overflow:%u\n",
+                    _opt.rate, _opt.window, _limited, _rate.peak(), _rate.overflows());
+        }
+        if(_opt.device)
+        {
+            fprintf(stderr, "decode:%s budget:%.0fus 4:2:0:%u average:%.0fus max:%.0fus over:%u\n", _opt.device->name, _opt.decodeUs,
+                    _subsampled, _offsets.empty() ? 0.0 : _decodeUs / _offsets.size(), _maxDecodeUs, _overBudget);
+        }
+        if(_belowMin || _oversized)
+        {
+            // Blocks over JPG_BUFFER_SIZE are truncated on the device
+            fprintf(stderr, "below quality %d:%u over %u bytes:%u\n", _opt.minQuality, _belowMin, _opt.maxSize, _oversized);
+        }
+        return ok && !_offsets.empty() && !_oversized;
+    }
+
+  private:
+    void worker()
+    {
+        for(;;)
+        {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cv.wait(lock, [&] {
+                    job.reset();
+                    for(auto& j : _jobs) { if(!j->taken) { job = j; break; } }
+                    return job || _eof;
+                });
+                if(!job) { return; }
+                job->taken = true;
+            }
+            process(*job, _opt);
+            std::lock_guard<std::mutex> lock(_mutex);
+            job->done = true;
+            _cv.notify_all();
+        }
+    }
+
+    // Blocks are written in the order of the frames
+    void writer()
+    {
+        std::vector<uint8_t> pcm;
+        for(;;)
+        {
+            std::shared_ptr<Job> job;
+            std::vector<std::pair<uint32_t, uint32_t> > ahead; // Image and the rest of the block
+            {
+                // The lookahead of the rate is done as well
+                const size_t la = _rate.enabled() ? _rate.lookahead() : 1;
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cv.wait(lock, [&] {
+                    if(_jobs.size() < la && !_eof) { return false; }
+                    auto n = std::min(la, _jobs.size());
+                    return (n && std::all_of(_jobs.begin(), _jobs.begin() + n, [](const std::shared_ptr<Job>& j) { return j->done; }))
+                            || (_eof && _jobs.empty());
+                });
+                if(_jobs.empty()) { return; }
+                for(size_t i = 0; i < std::min(la, _jobs.size()); ++i)
+                {
+                    ahead.emplace_back((uint32_t)_jobs[i]->jpeg.size(), (uint32_t)(sizeof(gob::GMVBlock) + _wblk));
+                }
+                job = _jobs.front();
+                _jobs.pop_front();
+                _cv.notify_all();
+            }
+
+            uint32_t wsz = _wblk;
+            _wmod += _frac;
+            if(_wmod >= 1.0) { _wmod -= 1.0; wsz += _wadd; }
+            _wav.read(pcm, wsz);
+
+            // Lower the quality to keep the sustained rate
+            if(_rate.enabled())
+            {
+                ahead[0].second = sizeof(gob::GMVBlock) + pcm.size();
+                uint32_t budget = _rate.budget(ahead);
+                if(job->jpeg.size() > budget) { limit(*job, budget); }
+                _rate.push(sizeof(gob::GMVBlock) + job->jpeg.size() + pcm.size());
+            }
+
+            _offsets.push_back(ftell(_out));
+            gob::GMVBlock blk{ { (uint32_t)job->jpeg.size(), (uint32_t)pcm.size() } };
+            fwrite(&blk, sizeof(blk), 1, _out);
+            fwrite(job->jpeg.data(), 1, job->jpeg.size(), _out);
+            fwrite(pcm.data(), 1, pcm.size(), _out);
+            if(job->quality) { ++_reencoded; _qualities += job->quality; }
+            _imageBytes += job->jpeg.size();
+            if(job->quality && job->quality < _opt.minQuality) { ++_belowMin; }
+            if(job->jpeg.size() > _opt.maxSize) { ++_oversized; }
+            if(job->samp) { ++_subsampled; }
+            _decodeUs += job->us;
+            _maxDecodeUs = std::max(_maxDecodeUs, job->us);
+            if(_opt.device && (job->us < 0.0 || job->us > _opt.decodeUs)) { ++_overBudget; }
+            if(_opt.verbose) { fprintf(stderr, "Image %u size:%zu wsize:%zu q:%d us:%.0f\n", job->frame, job->jpeg.size(), pcm.size(), job->quality, job->us); }
+        }
+    }
+
+    // Re-encode to the budget of the rate (on the writer, the following frames are not affected)
+    void limit(Job& job, const uint32_t budget)
+    {
+        if(job.quality && job.quality < _opt.minQuality) { return; } // Already below -q for the size
+        if(job.source.pixels.empty() && !decode(job.jpeg, job.source)) { return; }
+        if(!reencode(job, std::min(budget, _opt.maxSize), _opt)) { return; }
+        if(_opt.device) { job.us = decodeUs(*_opt.device, job.jpeg); }
+        ++_limited;
+    }
+
+    const Options& _opt;
+    WavReader& _wav;
+    const float _fps;
+    RateWindow _rate;
+    uint32_t _limited{};
+    uint32_t _wblk{}, _wadd{};
+    double _frac{}, _wmod{};
+
+    FILE* _out{};
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<std::shared_ptr<Job>> _jobs;
+    bool _eof{};
+    std::vector<uint32_t> _offsets;
+    uint32_t _reencoded{}, _qualities{};
+    uint64_t _imageBytes{};
+    uint32_t _subsampled{}, _overBudget{};
+    uint32_t _belowMin{}, _oversized{};
+    double _decodeUs{}, _maxDecodeUs{};
+};
+
+void usage()
+{
+    fprintf(stderr, "gmv_mux [-s jpeg_maximum_size] [-q minimum_quality] [-b bytes_per_sec] [-w window_sec] [-c board] [-p name=value]... [-t decode_us]\n"
+            "        [-r restart_interval] [-j threads] [--noindex] [-v] wav_path fps output_path\n"
+            "  MJPEG stream is read from stdin\n"
+            "  board:");
+    for(auto& b : boards) { fprintf(stderr, " %s", b.name); }
+    fprintf(stderr, "\n  name:");
+    for(auto& p : boardParams) { fprintf(stderr, " %s", p.name); }
+    fprintf(stderr, "\n  decode_us: Default is 80%% of the frame\n");
+}
+//
+}
+
+int main(int argc, char** argv)
+{
+    Options opt;
+    std::vector<const char*> args;
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(a == "-s" && hasValue) { opt.maxSize = atoi(argv[++i]); }
+        else if(a == "-q" && hasValue) { opt.minQuality = std::min(std::max(atoi(argv[++i]), 1), 100); }
+        else if(a == "-b" && hasValue) { opt.rate = atoi(argv[++i]); }
+        else if(a == "-w" && hasValue) { opt.window = std::max(0.1f, (float)atof(argv[++i])); }
+        else if(a == "-c" && hasValue)
+        {
+            auto board = findBoard(argv[++i]);
+            if(!board) { usage(); return 2; }
+            opt.custom = *board;
+            opt.device = &opt.custom;
+        }
+        else if(a == "-p" && hasValue && opt.device)
+        {
+            if(!setBoardParam(opt.custom, argv[++i])) { usage(); return 2; }
+        }
+        else if(a == "-t" && hasValue) { opt.decodeUs = atof(argv[++i]); }
+        else if(a == "-r" && hasValue) { opt.restart = atoi(argv[++i]); }
+        else if(a == "-j" && hasValue) { opt.threads = atoi(argv[++i]); }
+        else if(a == "--noindex") { opt.index = false; }
+        else if(a == "-v") { opt.verbose = true; }
+        else if(a[0] == '-' && a.size() > 1) { usage(); return 2; }
+        else { args.push_back(argv[i]); }
+    }
+    if(args.size() != 3) { usage(); return 2; }
+    if(!opt.threads) { opt.threads = std::max(1U, std::thread::hardware_concurrency()); }
+
+    float fps = atof(args[1]);
+    if(fps < 1.0f || fps > 30.0f) { fprintf(stderr, "Invalid frame_rate range (1.0 - 30.0)\n"); return 2; }
+    // Decoding overlaps the DMA of the bands, the rest of the frame is left for the loop and the audio
+    if(opt.decodeUs <= 0.0) { opt.decodeUs = 0.8e6 / fps; }
+    WavReader wav;
+    if(!wav.open(args[0])) { fprintf(stderr, "Failed to open wav %s\n", args[0]); return 1; }
+
+    Muxer mux(opt, wav, fps);
+    return mux.run(stdin, args[2]) ? 0 : 1;
+}
@@ -0,0 +1,397 @@
+/*
+  gmv_sim
+  Predict the playback of GMV on the device.
+  Each frame is decoded by TJpgD and MainClass on the host to get the work (bytes, counters of TJpgD, pixels and bands),
+  then the work is put on the timeline of loopRender() in main.cpp with the cost parameters of the board. (board_model.hpp)
+
+  gmv_sim [-b board] [-p name=value]... [-s] [-W width] [-H height] [-n bands] [-l lines] [-o timeline.csv] file.gmv
+
+  Model
+  - SD read : The prefetcher reads a block while the main loop releases the bus. (SD and LCD share the SPI bus)
+  - Decode  : Core 1 is Huffman and IDCT, core 0 is the color conversion and the write to the band.
+              Core 1 runs ahead of core 0 up to the ring of decomp_multitask. (-s : decomp on core 1 only)
+  - DMA     : A band is pushed when it is written and the DMA is idle. The band buffer is reused after its DMA.
+  - Clock   : gob::AVClock fed by the speaker model (The queue of AUDIO_QUEUE_DEPTH blocks).
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// The sources are compiled in this translation unit as jpg_bench does (The warnings of them are off)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#pragma GCC diagnostic ignored "-Wformat"
+#include "../src/tjpgdClass.cpp"
+#include "../src/MainClass.cpp"
+#include "../src/gob_gmv_file.hpp"
+#include "../src/gob_av_clock.hpp"
+#pragma GCC diagnostic pop
+#include "main_class_probe.hpp"
+#include "board_model.hpp"
+
+namespace
+{
+// Same as main.cpp
+constexpr uint32_t NUMBER_OF_BUFFERS = 5;
+constexpr uint32_t AUDIO_QUEUE_DEPTH = 2;
+constexpr uint32_t READ_AHEAD_LOW = (NUMBER_OF_BUFFERS - AUDIO_QUEUE_DEPTH > 2) ? (NUMBER_OF_BUFFERS - AUDIO_QUEUE_DEPTH - 1) : 1;
+constexpr double Infinity = std::numeric_limits<double>::infinity();
+
+// Work of the block
+struct Band
+{
+    uint32_t pixels;  // Pushed pixels
+    double progress;  // Ratio of the decoded MCUs when the band is written
+};
+struct Work
+{
+    uint32_t imageSize{}, wavSize{};
+    uint32_t mcus{};   // Decoded MCUs (Out of the LCD are skipped)
+    uint32_t pixels{}; // Output pixels of the decoded MCUs
+    DecodeCount cost{}; // Counters of TJpgD
+    std::vector<Band> bands;
+    bool ok{};
+};
+
+Work* current{};
+uint32_t countWrite(TJpgD* jd, void* bitmap, TJpgD::JRECT* rect)
+{
+    ++current->mcus;
+    current->pixels += (rect->right - rect->left + 1) * (rect->bottom - rect->top + 1);
+    return MainClassProbe::write16(jd, bitmap, rect);
+}
+void countPush(void*, int32_t, int32_t, int32_t w, int32_t h)
+{
+    current->bands.push_back({ (uint32_t)(w * h), (double)current->mcus });
+}
+
+bool analyze(const char* path, const int32_t width, const int32_t height, uint8_t& bands, uint16_t& lines,
+             std::vector<Work>& works, float& fps, uint32_t& bytePerSec)
+{
+    gob::GMVFile gmv;
+    if(!gmv.open(path)) { fprintf(stderr, "Failed to open %s\n", path); return false; }
+    fps = gmv.fps();
+    bytePerSec = gmv.wavHeader().byte_per_sec;
+
+    LovyanGFX lcd(width, height);
+    MainClass mc;
+    if(!mc.setup(&lcd, bands, lines)) { return false; }
+    bands = mc.bands();
+    lines = mc.bandLines();
+    MainClassProbe::setWriter(mc, countWrite);
+    lcd.setOnPush(countPush, nullptr);
+
+    std::vector<uint8_t> buf(1024 * 1024);
+    while(!gmv.eof())
+    {
+        uint32_t isz{}, wsz{};
+        std::tie(isz, wsz) = gmv.readBlock(buf.data(), buf.size());
+        works.emplace_back();
+        current = &works.back();
+        current->imageSize = isz;
+        current->wavSize = wsz;
+        if(isz)
+        {
+            current->ok = mc.drawJpg(buf.data(), isz, false);
+            mc.wait();
+            current->cost = MainClassProbe::decoder(mc).cost;
+            for(auto& b : current->bands) { b.progress /= std::max(current->mcus, 1U); }
+            if(!current->ok) { fprintf(stderr, "Failed to decode the block %zu\n", works.size() - 1); }
+        }
+    }
+    current = nullptr;
+    return !works.empty();
+}
+
+// Frame on the timeline (us from the start of the loop)
+struct Frame
+{
+    double readEnd{}, load{}, drawStart{}, drawEnd{}, present{};
+    int64_t lateness{}; // At the start of the frame (Same as loopRender)
+    const char* status{}; // ok, late (started late), miss (shown after the next is due), drop, error
+};
+
+class Simulator
+{
+  public:
+    Simulator(const Board& b, const std::vector<Work>& w, const uint8_t bands, const bool multi)
+            : _b(b), _w(w), _bands(bands), _multi(multi), _readEnd(w.size(), Infinity), _slotDmaEnd(bands, 0.0) {}
+
+    void run(const float fps, const uint32_t bytePerSec, std::vector<Frame>& frames)
+    {
+        gob::AVClock clock;
+        clock.reset(bytePerSec, fps);
+        const int64_t fd = clock.frameDuration();
+        std::vector<double> wavEnd;
+        uint64_t wavTotal{};
+        uint32_t playFrame{};
+        double t{};
+
+        for(uint32_t n = 0; n < _w.size(); ++n)
+        {
+            auto& w = _w[n];
+            Frame f{};
+            t += _b.loopUs;
+
+            // 1:Load (The block is read in the released window)
+            t = waitBlock(n, t);
+            if(t == Infinity) { break; }
+            f.readEnd = _readEnd[n];
+            f.load = t;
+
+            // 2:Audio (playRaw waits for the free slot of the speaker queue)
+            if(w.wavSize && bytePerSec)
+            {
+                bool underrun = wavTotal && t >= wavEnd.back();
+                if(wavEnd.size() >= AUDIO_QUEUE_DEPTH) { t = std::max(t, wavEnd[wavEnd.size() - AUDIO_QUEUE_DEPTH]); }
+                double start = wavEnd.empty() ? t : std::max(t, wavEnd.back());
+                wavEnd.push_back(start + w.wavSize * 1000000.0 / bytePerSec);
+                clock.pushAudio(w.wavSize, underrun, at(t));
+                if(underrun) { ++underruns; }
+                wavTotal += w.wavSize;
+            }
+
+            // 3:Presentation time
+            auto pts = clock.presentation(playFrame++);
+            f.lateness = clock.position(at(t)) - pts;
+            bool drop = !w.imageSize || !w.ok || f.lateness > fd;
+            if(drop) { t = release(t); }
+            else if(f.lateness < 0)
+            {
+                t = release(t);
+                t -= f.lateness;
+            }
+
+            if(!drop)
+            {
+                // 4,5:Occupy the bus and draw
+                t = occupy(t);
+                f.drawStart = t;
+                t = draw(w, t);
+                f.drawEnd = t;
+                f.present = _dmaEnd;
+                // 6:Release the bus if the read-ahead runs short
+                if(_nextRead - (n + 1) < READ_AHEAD_LOW) { t = release(t); }
+
+                // The frame should be on the LCD before the next frame is due
+                bool miss = clock.position(at(f.present)) - pts > fd;
+                f.status = miss ? "miss" : (f.lateness > fd / 4 ? "late" : "ok");
+            }
+            else
+            {
+                f.status = w.imageSize && !w.ok ? "error" : "drop";
+            }
+            _frameEnd.push_back(t);
+            frames.push_back(f);
+        }
+        end = std::max(t, _dmaEnd);
+    }
+
+    double busyRead{}, busyDma{}, busyCore1{}, busyCore0{}, end{};
+    uint32_t underruns{};
+
+  private:
+    static gob::AVClock::time_point at(const double us) { return gob::AVClock::time_point(ESP32Clock::duration((int64_t)us)); }
+
+    // Slot of the block is free when the block NUMBER_OF_BUFFERS before is released by the loop
+    double slotFree(const uint32_t block) const
+    {
+        if(block < NUMBER_OF_BUFFERS) { return 0.0; }
+        uint32_t f = block - (NUMBER_OF_BUFFERS - AUDIO_QUEUE_DEPTH);
+        return f < _frameEnd.size() ? _frameEnd[f] : Infinity;
+    }
+
+    // Read the next block if it starts before until in the released window
+    bool readOne(const double until)
+    {
+        if(!_released || _nextRead >= _w.size()) { return false; }
+        double start = std::max({ _readCursor, _windowStart, slotFree(_nextRead) });
+        if(start >= until) { return false; }
+        auto& w = _w[_nextRead];
+        double dur = _b.sdOverheadUs + (w.imageSize + w.wavSize + sizeof(gob::GMVBlock)) / _b.sdBytesPerUs;
+        _readEnd[_nextRead++] = _readCursor = start + dur;
+        busyRead += dur;
+        return true;
+    }
+    double waitBlock(const uint32_t n, const double t)
+    {
+        while(_nextRead <= n && readOne(Infinity)) { ; }
+        return std::max(t, _readEnd[n]);
+    }
+    // occupyBus() waits for the block in reading
+    double occupy(const double t)
+    {
+        if(!_released) { return t; }
+        while(readOne(t)) { ; }
+        _released = false;
+        return std::max(t, _readCursor);
+    }
+    // releaseBus() waits for the output and the DMA
+    double release(double t)
+    {
+        if(_released) { return t; }
+        t = std::max({ t, _outEnd, _dmaEnd });
+        _released = true;
+        _windowStart = t;
+        return t;
+    }
+
+    // drawJpg returns when core 1 has decoded all. The output and the DMA go on
+    double draw(const Work& w, double t)
+    {
+        const double start = std::max(t, _outEnd) + _b.prepareUs; // waitOutput
+        const double c1 = core1Us(_b, w.cost);
+        const double c0 = core0Us(_b, w.pixels);
+        const double perMcu0 = w.mcus ? c0 / w.mcus : 0.0;
+        const double slack = perMcu0 * queue_max; // Core 1 runs ahead up to the ring
+        busyCore1 += _multi ? c1 : c1 + c0;
+        busyCore0 += _multi ? c0 : 0.0;
+
+        double out = start, prev{};
+        for(auto& b : w.bands)
+        {
+            const double share = b.progress - prev;
+            const double bufFree = _slotDmaEnd[_bandSeq % _bands];
+            if(_multi)
+            {
+                double produced = std::max(start + b.progress * c1, out - slack);
+                out = std::max(std::max(out, bufFree) + share * c0, produced + perMcu0);
+            }
+            else
+            {
+                out = std::max(out, bufFree) + share * (c1 + c0);
+            }
+            double dma = _b.dmaSetupUs + b.pixels * 2 / _b.lcdBytesPerUs;
+            _dmaEnd = std::max(out, _dmaEnd) + dma;
+            _slotDmaEnd[_bandSeq++ % _bands] = _dmaEnd;
+            busyDma += dma;
+            prev = b.progress;
+        }
+        if(!_multi) { _outEnd = out; return out; }
+        _outEnd = out;
+        return std::max(start + c1, out - slack);
+    }
+
+    const Board& _b;
+    const std::vector<Work>& _w;
+    const uint8_t _bands;
+    const bool _multi;
+
+    // Prefetcher and the bus
+    bool _released{true};
+    double _windowStart{}, _readCursor{};
+    uint32_t _nextRead{};
+    std::vector<double> _readEnd, _frameEnd;
+    // Output task and DMA
+    double _outEnd{}, _dmaEnd{};
+    std::vector<double> _slotDmaEnd;
+    uint32_t _bandSeq{};
+};
+
+void usage()
+{
+    fprintf(stderr, "gmv_sim [-b board] [-p name=value]... [-s] [-W width] [-H height] [-n bands] [-l lines] [-o timeline.csv] file.gmv\n");
+    fprintf(stderr, " boards:");
+    for(auto& b : boards) { fprintf(stderr, " %s", b.name); }
+    fprintf(stderr, "\n params:");
+    for(auto& p : boardParams) { fprintf(stderr, " %s", p.name); }
+    fprintf(stderr, "\n");
+}
+
+// 1,2,3,7 => "1-3,7"
+std::string ranges(const std::vector<uint32_t>& v)
+{
+    std::string s;
+    for(size_t i = 0; i < v.size();)
+    {
+        size_t j = i;
+        while(j + 1 < v.size() && v[j + 1] == v[j] + 1) { ++j; }
+        if(!s.empty()) { s += ","; }
+        s += std::to_string(v[i]);
+        if(j > i) { s += "-" + std::to_string(v[j]); }
+        i = j + 1;
+    }
+    return s;
+}
+//
+}
+
+int main(int argc, char** argv)
+{
+    Board board = boards[0];
+    bool multi = true;
+    int32_t width = 320, height = 240;
+    uint8_t bands{};
+    uint16_t lines{};
+    const char* path{};
+    const char* output{};
+
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(a == "-b" && hasValue)
+        {
+            auto b = findBoard(argv[++i]);
+            if(!b) { usage(); return 2; }
+            board = *b;
+        }
+        else if(a == "-p" && hasValue)
+        {
+            if(!setBoardParam(board, argv[++i])) { usage(); return 2; }
+        }
+        else if(a == "-s") { multi = false; }
+        else if(a == "-W" && hasValue) { width = atoi(argv[++i]); }
+        else if(a == "-H" && hasValue) { height = atoi(argv[++i]); }
+        else if(a == "-n" && hasValue) { bands = atoi(argv[++i]); }
+        else if(a == "-l" && hasValue) { lines = atoi(argv[++i]); }
+        else if(a == "-o" && hasValue) { output = argv[++i]; }
+        else if(a[0] == '-' || path) { usage(); return 2; }
+        else { path = argv[i]; }
+    }
+    if(!path) { usage(); return 2; }
+
+    std::vector<Work> works;
+    float fps{};
+    uint32_t bytePerSec{};
+    if(!analyze(path, width, height, bands, lines, works, fps, bytePerSec) || fps <= 0.0f) { return 1; }
+
+    Simulator sim(board, works, bands, multi);
+    std::vector<Frame> frames;
+    sim.run(fps, bytePerSec, frames);
+
+    // Timeline
+    FILE* fp = output ? fopen(output, "w") : stdout;
+    if(!fp) { fprintf(stderr, "Failed to open %s\n", output); return 1; }
+    fprintf(fp, "frame,image,wav,read_end,load,draw_start,draw_end,present,lateness,status\n");
+    std::vector<uint32_t> missed;
+    uint32_t shown{}, late{}, dropped{};
+    for(uint32_t i = 0; i < frames.size(); ++i)
+    {
+        auto& f = frames[i];
+        fprintf(fp, "%u,%u,%u,%.0f,%.0f,%.0f,%.0f,%.0f,%lld,%s\n", i, works[i].imageSize, works[i].wavSize,
+                f.readEnd, f.load, f.drawStart, f.drawEnd, f.present, (long long)f.lateness, f.status);
+        bool drop = !strcmp(f.status, "drop") || !strcmp(f.status, "error");
+        if(!drop) { ++shown; } // Missed frames are shown late
+        if(!strcmp(f.status, "late")) { ++late; }
+        if(drop) { ++dropped; }
+        if(drop || !strcmp(f.status, "miss")) { missed.push_back(i); }
+    }
+    if(output) { fclose(fp); }
+
+    // Summary
+    const double end = std::max(sim.end, 1.0);
+    printf("[%s] board:%s bands:%u lines:%u %s\n", path, board.name, bands, lines, multi ? "multitask" : "single task");
+    printf("frames:%zu fps:%2.2f (target %2.2f) drop:%u late:%u miss:%zu underrun:%u\n",
+           frames.size(), shown * 1000000.0 / end, fps, dropped, late, missed.size(), sim.underruns);
+    printf("busy SD:%u%% DMA:%u%% core1:%u%% core0:%u%%\n",
+           (uint32_t)(sim.busyRead * 100 / end), (uint32_t)(sim.busyDma * 100 / end),
+           (uint32_t)(sim.busyCore1 * 100 / end), (uint32_t)(sim.busyCore0 * 100 / end));
+    if(!missed.empty()) { printf("missed:%s\n", ranges(missed).c_str()); }
+    return missed.empty() ? 0 : 1;
+}
@@ -0,0 +1,470 @@
+/*
+  jpg_bench
+  Benchmark of the decoder kernels and the pixel writers on the host,
+  the IDCT dispatch against block_idct<8> for all the blocks (JD_IDCTDISPATCH 0, tjpgd_idct8.cpp),
+  and check of the decoded image against libjpeg and the float color conversion (JD_FIXEDCOLOR 0, tjpgd_float.cpp).
+
+  jpg_bench [-r repeat] [-n frames] [-t psnr] <directory of JPEG | file.gmv | file.jpg>...
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <dirent.h>
+
+// The kernels are local to each source, so the sources are compiled in this translation unit.
+// They assume 32bit size_t and int_fast16_t, so the warnings of them are off.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#pragma GCC diagnostic ignored "-Wformat"
+#include "../src/tjpgdClass.cpp"
+#include "../src/gob_jpg_sprite.cpp"
+#include "../src/MainClass.cpp"
+#include "../src/gob_gmv_file.hpp"
+#pragma GCC diagnostic pop
+#include "main_class_probe.hpp"
+#include "mcu_walk.hpp"
+
+#if defined(HAVE_LIBJPEG)
+#include <jpeglib.h>
+#endif
+
+// tjpgd_float.cpp
+bool decodeFloatColor(const uint8_t* data, const uint32_t size, uint32_t& width, uint32_t& height, std::vector<uint8_t>& rgb);
+// tjpgd_idct8.cpp
+double mcuLoadIdct8Ns(const uint8_t* data, const uint32_t size);
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+double elapsedNs(const Clock::time_point& from) { return std::chrono::duration<double, std::nano>(Clock::now() - from).count(); }
+
+struct Frame
+{
+    std::string name;
+    std::vector<uint8_t> data;
+};
+
+// Accumulated time and the processed pixels
+struct Measure
+{
+    double ns{};
+    uint64_t pixels{};
+    double perPixel() const { return pixels ? ns / pixels : 0.0; }
+};
+
+bool endsWith(const std::string& s, const char* ext)
+{
+    size_t n = strlen(ext);
+    if(s.size() < n) { return false; }
+    return std::equal(s.end() - n, s.end(), ext, [](char a, char b) { return tolower(a) == b; });
+}
+
+bool loadFile(const std::string& path, std::vector<uint8_t>& out)
+{
+    FILE* fp = fopen(path.c_str(), "rb");
+    if(!fp) { return false; }
+    fseek(fp, 0, SEEK_END);
+    out.resize(ftell(fp));
+    fseek(fp, 0, SEEK_SET);
+    bool ok = fread(out.data(), 1, out.size(), fp) == out.size();
+    fclose(fp);
+    return ok;
+}
+
+// Images of the directory (*.jpg, *.jpeg), the blocks of GMV, or a JPEG file
+void collect(const std::string& path, std::vector<Frame>& frames, const size_t limit)
+{
+    DIR* dir = opendir(path.c_str());
+    if(dir)
+    {
+        std::vector<std::string> names;
+        while(auto ent = readdir(dir))
+        {
+            std::string n = ent->d_name;
+            if(endsWith(n, ".jpg") || endsWith(n, ".jpeg")) { names.push_back(path + "/" + n); }
+        }
+        closedir(dir);
+        std::sort(names.begin(), names.end());
+        for(auto& n : names) { if(frames.size() < limit) { collect(n, frames, limit); } }
+        return;
+    }
+    if(endsWith(path, ".gmv"))
+    {
+        gob::GMVFile gmv;
+        if(!gmv.open(path.c_str())) { fprintf(stderr, "Failed to open %s\n", path.c_str()); return; }
+        std::vector<uint8_t> buf(1024 * 1024);
+        while(!gmv.eof() && frames.size() < limit)
+        {
+            uint32_t isz{}, wsz{};
+            std::tie(isz, wsz) = gmv.readBlock(buf.data(), buf.size());
+            if(!isz && !wsz) { break; }
+            if(!isz) { continue; }
+            frames.push_back({ path + ":" + std::to_string(gmv.readCount()), std::vector<uint8_t>(buf.begin(), buf.begin() + isz) });
+        }
+        return;
+    }
+    Frame f{ path, {} };
+    if(!loadFile(path, f.data)) { fprintf(stderr, "Failed to read %s\n", path.c_str()); return; }
+    frames.push_back(std::move(f));
+}
+
+uint32_t nullOutput(TJpgD*, void*, TJpgD::JRECT*) { return 1; }
+
+// huffext, mcu_load and mcu_output of the image (scale 1/1)
+bool measureDecoder(const Frame& f, Measure& huff, Measure& load, Measure& output)
+{
+    TJpgD jd{};
+    jd.format = TJpgD::JDF_SWAP565;
+    if(jd.prepare(f.data.data(), f.data.size(), nullptr) != TJpgD::JDR_OK) { return false; }
+    const uint64_t pixels = (uint64_t)jd.width * jd.height;
+
+    // huffext and bitext only
+    auto start = Clock::now();
+    if(forEachMCU(jd, [&](uint_fast16_t, uint_fast16_t) { return mcu_skip(&jd); }) != TJpgD::JDR_OK) { return false; }
+    huff.ns += elapsedNs(start);
+    huff.pixels += pixels;
+
+    // Huffman, de-quantize and IDCT. Decoded MCUs are kept for mcu_output
+    struct MCU { jd_yuv_t buf[384]; uint_fast16_t x, y; };
+    std::vector<MCU> mcus;
+    mcus.reserve(((jd.width + 15) / 16) * ((jd.height + 15) / 16) * 4);
+    int32_t tmp[64 * 3];
+    jd.prepare(f.data.data(), f.data.size(), nullptr);
+    start = Clock::now();
+    auto rc = forEachMCU(jd, [&](uint_fast16_t x, uint_fast16_t y) {
+        mcus.emplace_back();
+        mcus.back().x = x;
+        mcus.back().y = y;
+        if(jd.comps_in_frame == 1) { std::fill(std::begin(mcus.back().buf), std::end(mcus.back().buf), 128); }
+        return mcu_load(&jd, mcus.back().buf, tmp);
+    });
+    load.ns += elapsedNs(start);
+    load.pixels += pixels;
+    if(rc != TJpgD::JDR_OK) { return false; }
+
+    // Color conversion to swap565
+    uint8_t workbuf[768];
+    start = Clock::now();
+    for(auto& m : mcus) { mcu_output(&jd, m.buf, workbuf, nullOutput, m.x, m.y); }
+    output.ns += elapsedNs(start);
+    output.pixels += pixels;
+    return true;
+}
+
+// IDCT of the blocks in the pool. The pool is copied out of the timing, IDCT breaks the source
+template<uint_fast8_t N> void measureIDCT(const std::vector<int32_t>& pool, Measure& m, const uint32_t blocks)
+{
+    const uint32_t n = pool.size() / 64;
+    std::vector<int32_t> work;
+    jd_yuv_t out[64];
+    volatile jd_yuv_t sink{};
+    for(uint32_t done = 0; done < blocks; done += n)
+    {
+        work = pool;
+        auto start = Clock::now();
+        for(uint32_t i = 0; i < n; ++i)
+        {
+            block_idct<N>(&work[i * 64], out);
+            sink = out[i & 63];
+        }
+        m.ns += elapsedNs(start);
+        m.pixels += (uint64_t)n * 64;
+    }
+    (void)sink;
+}
+
+// block_idct<8> on the full blocks, and block_idct<4> on the blocks of the upper left 4x4 elements
+void measureIDCT(Measure& idct8, Measure& idct4, const uint32_t blocks)
+{
+    std::vector<int32_t> full(64 * 256), low(64 * 256);
+    uint32_t seed = 1;
+    for(size_t i = 0; i < full.size(); ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        full[i] = (int32_t)((seed >> 16) % 1024) - 512;
+        low[i] = ((i & 7) < 4 && (i & 63) < 32) ? full[i] : 0;
+    }
+    measureIDCT<8>(full, idct8, blocks);
+    measureIDCT<4>(low, idct4, blocks);
+}
+
+// mcu_load of the frame with the dispatch of the IDCT and with block_idct<8> for all the blocks (tjpgd_idct8.cpp)
+bool measureDispatch(const Frame& f, double& dispatchNs, double& idct8Ns)
+{
+    double a = mcuLoadNs(f.data.data(), f.data.size());
+    double b = mcuLoadIdct8Ns(f.data.data(), f.data.size());
+    if(a < 0.0 || b < 0.0) { return false; }
+    dispatchNs += a;
+    idct8Ns += b;
+    return true;
+}
+
+// Writers of JpgSprite, an MCU (16x16) at a time over the sprite
+template<typename F> void measureWriter(F func, const uint32_t srcBytes, const uint32_t dstBytes, Measure& m, const uint32_t frames)
+{
+    constexpr uint32_t w = 320, h = 240, mcu = 16;
+    std::vector<uint8_t> src(mcu * mcu * srcBytes), dst(w * h * dstBytes);
+    for(size_t i = 0; i < src.size(); ++i) { src[i] = (uint8_t)(i * 7); }
+
+    auto start = Clock::now();
+    for(uint32_t f = 0; f < frames; ++f)
+    {
+        for(uint32_t y = 0; y < h; y += mcu)
+        {
+            for(uint32_t x = 0; x < w; x += mcu)
+            {
+                func(dst.data() + (y * w + x) * dstBytes, src.data(), mcu, w, mcu, mcu);
+            }
+        }
+    }
+    m.ns += elapsedNs(start);
+    m.pixels += (uint64_t)w * h * frames;
+}
+
+std::atomic<uint64_t> write16Ns{}, write16Pixels{};
+uint32_t timedWrite16(TJpgD* jd, void* bitmap, TJpgD::JRECT* rect)
+{
+    auto start = Clock::now();
+    auto ret = MainClassProbe::write16(jd, bitmap, rect);
+    write16Ns += (uint64_t)elapsedNs(start);
+    write16Pixels += (uint64_t)(rect->right - rect->left + 1) * (rect->bottom - rect->top + 1);
+    return ret;
+}
+
+// Frames per second of the whole path
+double measureFps(const std::vector<Frame>& frames, const uint32_t repeat, const int mode)
+{
+    LovyanGFX lcd(320, 240);
+    MainClass mc;
+    if(mode && !mc.setup(&lcd)) { return 0.0; }
+    if(mode == 1) { MainClassProbe::setWriter(mc, timedWrite16); }
+
+    uint32_t count{};
+    auto start = Clock::now();
+    for(uint32_t r = 0; r < repeat; ++r)
+    {
+        for(auto& f : frames)
+        {
+            if(mode == 0)
+            {
+                TJpgD jd{};
+                jd.format = TJpgD::JDF_SWAP565;
+                if(jd.prepare(f.data.data(), f.data.size(), nullptr) == TJpgD::JDR_OK) { jd.decomp(nullOutput); }
+            }
+            else
+            {
+                mc.drawJpg(f.data.data(), f.data.size(), mode == 2);
+            }
+            ++count;
+        }
+    }
+    if(mode) { mc.wait(); }
+    double ns = elapsedNs(start);
+    return ns > 0 ? count * 1e9 / ns : 0.0;
+}
+
+// Decode to RGB888 at 1/1
+struct RGBImage
+{
+    uint32_t width{}, height{};
+    std::vector<uint8_t> rgb;
+};
+
+uint32_t rgbOutput(TJpgD* jd, void* bitmap, TJpgD::JRECT* rect)
+{
+    auto img = (RGBImage*)jd->device;
+    const uint8_t* src = (const uint8_t*)bitmap;
+    uint32_t w = rect->right - rect->left + 1;
+    for(int32_t y = rect->top; y <= rect->bottom; ++y)
+    {
+        memcpy(&img->rgb[(y * img->width + rect->left) * 3], src, w * 3);
+        src += w * 3;
+    }
+    return 1;
+}
+
+bool decodeTJpgD(const Frame& f, RGBImage& img)
+{
+    TJpgD jd{};
+    jd.format = TJpgD::JDF_RGB888;
+    if(jd.prepare(f.data.data(), f.data.size(), &img) != TJpgD::JDR_OK) { return false; }
+    img.width = jd.width;
+    img.height = jd.height;
+    img.rgb.assign(img.width * img.height * 3, 0);
+    return jd.decomp(rgbOutput) == TJpgD::JDR_OK;
+}
+
+#if defined(HAVE_LIBJPEG)
+// Nearest upsampling and the integer IDCT, same as TJpgD
+bool decodeReference(const Frame& f, RGBImage& img)
+{
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, f.data.data(), f.data.size());
+    if(jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) { jpeg_destroy_decompress(&cinfo); return false; }
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.do_fancy_upsampling = FALSE;
+    cinfo.dct_method = JDCT_ISLOW;
+    jpeg_start_decompress(&cinfo);
+    img.width = cinfo.output_width;
+    img.height = cinfo.output_height;
+    img.rgb.assign(img.width * img.height * 3, 0);
+    while(cinfo.output_scanline < cinfo.output_height)
+    {
+        JSAMPROW row = &img.rgb[cinfo.output_scanline * img.width * 3];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+#endif
+
+double psnr(const RGBImage& a, const RGBImage& b, uint32_t& maxDiff)
+{
+    double se{};
+    maxDiff = 0;
+    for(size_t i = 0; i < a.rgb.size(); ++i)
+    {
+        int d = (int)a.rgb[i] - (int)b.rgb[i];
+        se += d * d;
+        maxDiff = std::max<uint32_t>(maxDiff, std::abs(d));
+    }
+    double mse = se / a.rgb.size();
+    return mse > 0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : 99.0;
+}
+
+void usage()
+{
+    fprintf(stderr, "jpg_bench [-r repeat] [-n frames] [-t psnr] <directory of JPEG | file.gmv | file.jpg>...\n");
+}
+//
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t repeat = 3;
+    size_t limit = 1000;
+    double threshold = 30.0; // PSNR (dB) against the reference
+    std::vector<std::string> inputs;
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string a = argv[i];
+        if(a == "-r" && i + 1 < argc) { repeat = std::max(1, atoi(argv[++i])); }
+        else if(a == "-n" && i + 1 < argc) { limit = std::max(1, atoi(argv[++i])); }
+        else if(a == "-t" && i + 1 < argc) { threshold = atof(argv[++i]); }
+        else if(a[0] == '-') { usage(); return 2; }
+        else { inputs.push_back(a); }
+    }
+    if(inputs.empty()) { usage(); return 2; }
+
+    std::vector<Frame> frames;
+    for(auto& in : inputs) { collect(in, frames, limit); }
+    if(frames.empty()) { fprintf(stderr, "No image\n"); return 2; }
+    printf("Frames:%zu Repeat:%u\n", frames.size(), repeat);
+
+    // Kernels
+    Measure huff, load, output, idct8, idct4, w565, w888, w332;
+    uint32_t failed{};
+    for(uint32_t r = 0; r < repeat; ++r)
+    {
+        for(auto& f : frames)
+        {
+            if(!measureDecoder(f, huff, load, output) && r == 0) { fprintf(stderr, "Failed to decode %s\n", f.name.c_str()); ++failed; }
+        }
+    }
+    measureIDCT(idct8, idct4, 100000 * repeat);
+    double loadDispatch{}, loadIdct8{};
+    uint32_t loaded{};
+    for(uint32_t r = 0; r < repeat; ++r)
+    {
+        for(auto& f : frames) { loaded += measureDispatch(f, loadDispatch, loadIdct8); }
+    }
+    measureWriter(write565, 2, 2, w565, 100 * repeat);
+    measureWriter(write888, 3, 3, w888, 100 * repeat);
+    measureWriter(write332, 3, 1, w332, 100 * repeat);
+
+    // Whole path
+    double fpsDecomp = measureFps(frames, repeat, 0);
+    write16Ns = write16Pixels = 0;
+    double fpsSingle = measureFps(frames, repeat, 1);
+    Measure w16{ (double)write16Ns, write16Pixels };
+    double fpsMulti = measureFps(frames, repeat, 2);
+
+    printf("%-24s %10s\n", "Kernel", "ns/pixel");
+    const std::pair<const char*, const Measure*> kernels[] =
+    {
+        { "huffext (mcu_skip)", &huff }, { "mcu_load", &load }, { "block_idct<8>", &idct8 }, { "block_idct<4>", &idct4 },
+        { "mcu_output (swap565)", &output }, { "MainClass::jpgWrite16", &w16 },
+        { "write565", &w565 }, { "write888", &w888 }, { "write332", &w332 },
+    };
+    for(auto& k : kernels) { printf("%-24s %10.3f\n", k.first, k.second->perPixel()); }
+
+    printf("%-24s %10s\n", "mcu_load per frame", "us");
+    printf("%-24s %10.2f\n", "IDCT dispatch", loaded ? loadDispatch / loaded / 1000.0 : 0.0);
+    printf("%-24s %10.2f\n", "block_idct<8> only", loaded ? loadIdct8 / loaded / 1000.0 : 0.0);
+
+    printf("%-24s %10s\n", "Path (320x240 LCD)", "fps");
+    printf("%-24s %10.2f\n", "decomp (no output)", fpsDecomp);
+    printf("%-24s %10.2f\n", "drawJpg single task", fpsSingle);
+    printf("%-24s %10.2f\n", "drawJpg multitask", fpsMulti);
+
+    // Check the decoded image
+#if defined(HAVE_LIBJPEG)
+    double minPsnr = 99.0;
+    uint32_t maxDiff{}, below{};
+    for(auto& f : frames)
+    {
+        RGBImage a, b;
+        if(!decodeTJpgD(f, a) || !decodeReference(f, b) || a.width != b.width || a.height != b.height)
+        {
+            fprintf(stderr, "Failed to compare %s\n", f.name.c_str());
+            ++failed;
+            continue;
+        }
+        uint32_t md{};
+        double p = psnr(a, b, md);
+        minPsnr = std::min(minPsnr, p);
+        maxDiff = std::max(maxDiff, md);
+        if(p < threshold) { printf("  %s PSNR:%.2f dB max diff:%u\n", f.name.c_str(), p, md); ++below; }
+    }
+    printf("Reference (libjpeg) min PSNR:%.2f dB max diff:%u below %.1f dB:%u\n", minPsnr, maxDiff, threshold, below);
+    failed += below;
+#else
+    printf("Reference check is skipped (Build without libjpeg)\n");
+#endif
+
+    // The fixed-point conversion rounds, the float one truncates. They differ by 1 at most
+    uint32_t colorDiff{}, colorOver{};
+    uint64_t colorDiffers{};
+    for(auto& f : frames)
+    {
+        RGBImage a, b;
+        if(!decodeTJpgD(f, a) || !decodeFloatColor(f.data.data(), f.data.size(), b.width, b.height, b.rgb) || a.rgb.size() != b.rgb.size())
+        {
+            fprintf(stderr, "Failed to compare the color conversion %s\n", f.name.c_str());
+            ++failed;
+            continue;
+        }
+        uint32_t md{};
+        for(size_t i = 0; i < a.rgb.size(); ++i)
+        {
+            uint32_t d = std::abs((int)a.rgb[i] - (int)b.rgb[i]);
+            colorDiffers += d != 0;
+            md = std::max(md, d);
+        }
+        colorDiff = std::max(colorDiff, md);
+        if(md > 1) { printf("  %s fixed-point color max diff:%u\n", f.name.c_str(), md); ++colorOver; }
+    }
+    printf("Fixed-point color against float max diff:%u differing samples:%llu over 1:%u\n", colorDiff, (unsigned long long)colorDiffers, colorOver);
+    failed += colorOver;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,20 @@
+/*
+  Access to the writer and the decoder of MainClass for the host tools (friend of MainClass)
+*/
+#ifndef HOST_MAIN_CLASS_PROBE_HPP
+#define HOST_MAIN_CLASS_PROBE_HPP
+
+#include "../src/MainClass.h"
+
+struct MainClassProbe
+{
+    using Writer = uint32_t(*)(TJpgD*, void*, TJpgD::JRECT*);
+
+    // Replace the writer of the pixels to the band (Set after setup)
+    static void setWriter(MainClass& mc, Writer w) { mc._fp_jpgWrite = w; }
+    // Decoder (TJpgD::cost of the last drawJpg by decomp)
+    static const TJpgD& decoder(const MainClass& mc) { return mc._jdec; }
+    // Writer of RGB565
+    static uint32_t write16(TJpgD* jd, void* bitmap, TJpgD::JRECT* rect) { return MainClass::jpgWrite16(jd, bitmap, rect); }
+};
+#endif
@@ -0,0 +1,50 @@
+/*
+  Walk of the MCUs for the host tools
+  Included after tjpgdClass.cpp, restart() and mcu_load() are local to it.
+*/
+#ifndef HOST_MCU_WALK_HPP
+#define HOST_MCU_WALK_HPP
+
+#include <chrono>
+
+namespace
+{
+// Walk all the MCUs of the image in the stream order
+template<typename F> TJpgD::JRESULT forEachMCU(TJpgD& jd, F func)
+{
+    const uint_fast16_t mx = jd.msx * 8, my = jd.msy * 8;
+    uint16_t rst{}, rsc{};
+    jd.dcv[0] = jd.dcv[1] = jd.dcv[2] = 0;
+    for(int32_t y = 0; y < jd.height; y += my)
+    {
+        for(int32_t x = 0; x < jd.width; x += mx)
+        {
+            if(jd.nrst && rst++ == jd.nrst)
+            {
+                auto rc = restart(&jd, rsc++);
+                if(rc != TJpgD::JDR_OK) { return rc; }
+                rst = 1;
+            }
+            auto rc = func(x, y);
+            if(rc != TJpgD::JDR_OK) { return rc; }
+        }
+    }
+    return TJpgD::JDR_OK;
+}
+
+// Time (ns) of mcu_load over all the MCUs of the image (scale 1/1), negative if failed
+double mcuLoadNs(const uint8_t* data, const uint32_t size)
+{
+    TJpgD jd{};
+    jd.format = TJpgD::JDF_SWAP565;
+    if(jd.prepare(data, size, nullptr) != TJpgD::JDR_OK) { return -1.0; }
+    jd_yuv_t buf[384];
+    int32_t tmp[64 * 3];
+    auto start = std::chrono::steady_clock::now();
+    auto rc = forEachMCU(jd, [&](uint_fast16_t, uint_fast16_t) { return mcu_load(&jd, buf, tmp); });
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    return rc == TJpgD::JDR_OK ? ns : -1.0;
+}
+//
+}
+#endif
@@ -0,0 +1,257 @@
+/*
+  ring_test
+  Stress test of the MCU ring of decomp_multitask and the benchmark of the handoff.
+  Built for each ring size (JD_MT_QUEUE), see CMakeLists.txt.
+
+  - Two decoders run in parallel on their own threads, each with its own output task.
+  - Each frame is decoded by decomp_multitask with lineskip 0 and 2, and compared with decomp byte by byte.
+    Small rings go through the spare buffer of the producer, and the idle handshake of the consumer.
+  - linefunc checks that the lines of the band are all output, and the following lines are not output yet.
+  - Frames are made by libjpeg. (4:2:0, 4:4:4 and grayscale, without restart, with the restart intervals
+    that do not divide the MCU row (MCU path) and with an interval for each row (decomp_restart))
+
+  ring_test [-r repeat]
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <algorithm>
+#include <jpeglib.h>
+#include "tjpgdClass.h"
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+double elapsedNs(const Clock::time_point& from) { return std::chrono::duration<double, std::nano>(Clock::now() - from).count(); }
+
+struct Frame
+{
+    std::string name;
+    std::vector<uint8_t> data;
+    uint32_t mcus{};
+};
+
+// Gradient with the noise, the blocks have both the low and high frequencies
+bool makeFrame(const uint32_t w, const uint32_t h, const int samp, const uint32_t restart, Frame& f)
+{
+    const bool gray = samp == 0;
+    std::vector<uint8_t> pixels(w * h * (gray ? 1 : 3));
+    uint32_t seed = w * 31 + h * 17 + samp * 7 + restart;
+    for(uint32_t y = 0; y < h; ++y)
+    {
+        for(uint32_t x = 0; x < w; ++x)
+        {
+            seed = seed * 1103515245 + 12345;
+            int n = (int)((seed >> 16) & 31) - 16;
+            uint8_t* p = &pixels[(y * w + x) * (gray ? 1 : 3)];
+            p[0] = (uint8_t)std::min(std::max((int)(x * 255 / w) + n, 0), 255);
+            if(!gray)
+            {
+                p[1] = (uint8_t)std::min(std::max((int)(y * 255 / h) - n, 0), 255);
+                p[2] = (uint8_t)(((x / 24) ^ (y / 24)) & 1 ? 200 : 40);
+            }
+        }
+    }
+
+    jpeg_compress_struct cinfo{};
+    jpeg_error_mgr jerr;
+    unsigned char* buf{};
+    unsigned long size{};
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &buf, &size);
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = gray ? 1 : 3;
+    cinfo.in_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 85, TRUE);
+    if(!gray)
+    {
+        cinfo.comp_info[0].h_samp_factor = samp;
+        cinfo.comp_info[0].v_samp_factor = samp;
+    }
+    cinfo.restart_interval = restart;
+    jpeg_start_compress(&cinfo, TRUE);
+    while(cinfo.next_scanline < cinfo.image_height)
+    {
+        JSAMPROW row = &pixels[cinfo.next_scanline * w * (gray ? 1 : 3)];
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    f.data.assign(buf, buf + size);
+    free(buf);
+
+    const uint32_t mcu = gray ? 8 : samp * 8;
+    f.mcus = ((w + mcu - 1) / mcu) * ((h + mcu - 1) / mcu);
+    f.name = std::to_string(w) + "x" + std::to_string(h) + (gray ? " gray" : samp == 2 ? " 4:2:0" : " 4:4:4")
+            + " restart:" + std::to_string(restart);
+    return true;
+}
+
+// Output of a decoding (device of TJpgD)
+struct Canvas
+{
+    uint32_t width{}, height{};
+    std::vector<uint8_t> pixels;
+    std::unique_ptr<std::atomic<uint32_t>[]> written; // Output pixels of each line
+    std::atomic<uint32_t> nextLine{}; // Written by linefunc (on the consumer)
+    std::atomic<uint32_t> errors{};
+
+    void reset(const uint32_t w, const uint32_t h)
+    {
+        width = w;
+        height = h;
+        pixels.assign(w * h * 2, 0);
+        written.reset(new std::atomic<uint32_t>[h]);
+        for(uint32_t i = 0; i < h; ++i) { written[i] = 0; }
+        nextLine = 0;
+        errors = 0;
+    }
+};
+
+// Called on both the producer (spare buffer) and the consumer
+uint32_t output(TJpgD* jd, void* bitmap, TJpgD::JRECT* rect)
+{
+    auto c = (Canvas*)jd->device;
+    const uint8_t* src = (const uint8_t*)bitmap;
+    uint32_t w = rect->right - rect->left + 1;
+    for(int32_t y = rect->top; y <= rect->bottom; ++y)
+    {
+        memcpy(&c->pixels[(y * c->width + rect->left) * 2], src, w * 2);
+        src += w * 2;
+        c->written[y] += w;
+    }
+    return 1;
+}
+
+// The band is output, and the following bands are not
+uint32_t line(TJpgD* jd, uint32_t y, uint32_t h)
+{
+    auto c = (Canvas*)jd->device;
+    if(y != c->nextLine) { ++c->errors; }
+    for(uint32_t i = 0; i < c->height; ++i)
+    {
+        uint32_t n = c->written[i];
+        if(i < y + h ? n != c->width : n != 0) { ++c->errors; break; }
+    }
+    c->nextLine = y + h;
+    return 1;
+}
+
+uint32_t nullOutput(TJpgD*, void*, TJpgD::JRECT*) { return 1; }
+
+bool decode(TJpgD& jd, const Frame& f, Canvas& c, const bool multi, const uint32_t lineskip)
+{
+    jd.format = TJpgD::JDF_SWAP565;
+    if(jd.prepare(f.data.data(), f.data.size(), &c) != TJpgD::JDR_OK) { return false; }
+    jd.bayer = 0; // Same dither
+    c.reset(jd.width, jd.height);
+    auto rc = multi ? jd.decomp_multitask(output, line, lineskip) : jd.decomp(output, line, lineskip);
+    if(rc != TJpgD::JDR_OK) { return false; }
+    // The last band is output by the consumer
+    while(c.nextLine != c.height && !c.errors) { std::this_thread::yield(); }
+    return c.nextLine == c.height;
+}
+
+// All the frames with lineskip 0 and 2, returns the failures
+uint32_t stress(const std::vector<Frame>& frames, const uint32_t repeat, const uint32_t id)
+{
+    TJpgD jd{};
+    if(!jd.multitask_begin()) { fprintf(stderr, "[%u] multitask_begin failed\n", id); return 1; }
+    uint32_t failed{};
+    Canvas ref, out;
+    for(uint32_t r = 0; r < repeat; ++r)
+    {
+        for(size_t i = 0; i < frames.size(); ++i)
+        {
+            auto& f = frames[(i + id * 3) % frames.size()]; // The decoders are on the different frames
+            for(uint32_t lineskip : { 0U, 2U })
+            {
+                bool ok = decode(jd, f, ref, false, lineskip) && !ref.errors;
+                ok = ok && decode(jd, f, out, true, lineskip) && !out.errors;
+                ok = ok && ref.pixels == out.pixels;
+                if(!ok && r == 0)
+                {
+                    fprintf(stderr, "[%u] %s lineskip:%u failed (line errors:%u)\n", id, f.name.c_str(), lineskip, (uint32_t)out.errors);
+                }
+                failed += !ok;
+            }
+        }
+    }
+    jd.multitask_end();
+    return failed;
+}
+
+// Time per MCU of decomp and decomp_multitask without the output
+void handoff(const std::vector<Frame>& frames, const uint32_t repeat)
+{
+    TJpgD jd{};
+    if(!jd.multitask_begin()) { return; }
+    double ns[2]{};
+    uint64_t mcus{};
+    for(uint32_t r = 0; r < repeat; ++r)
+    {
+        for(auto& f : frames)
+        {
+            if(f.data.empty()) { continue; }
+            for(int multi = 0; multi < 2; ++multi)
+            {
+                jd.prepare(f.data.data(), f.data.size(), nullptr);
+                auto start = Clock::now();
+                if(multi) { jd.decomp_multitask(nullOutput); }
+                else { jd.decomp(nullOutput); }
+                ns[multi] += elapsedNs(start);
+            }
+            mcus += f.mcus;
+        }
+    }
+    jd.multitask_end();
+    printf("Handoff ring:%u decomp:%.1f ns/MCU decomp_multitask:%.1f ns/MCU\n", JD_MT_QUEUE, ns[0] / mcus, ns[1] / mcus);
+}
+//
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t repeat = 3;
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string a = argv[i];
+        if(a == "-r" && i + 1 < argc) { repeat = std::max(1, atoi(argv[++i])); }
+        else { fprintf(stderr, "ring_test [-r repeat]\n"); return 2; }
+    }
+
+    std::vector<Frame> frames;
+    const std::pair<uint32_t, uint32_t> sizes[] = { { 320, 240 }, { 200, 150 } };
+    for(auto& sz : sizes)
+    {
+        for(int samp : { 2, 1, 0 })
+        {
+            const uint32_t mcu = samp ? samp * 8 : 8;
+            for(uint32_t restart : { 0U, 3U, (sz.first + mcu - 1) / mcu })
+            {
+                frames.emplace_back();
+                makeFrame(sz.first, sz.second, samp, restart, frames.back());
+            }
+        }
+    }
+
+    // Two decoders in parallel
+    uint32_t failed[2]{};
+    std::thread t0([&] { failed[0] = stress(frames, repeat, 0); });
+    std::thread t1([&] { failed[1] = stress(frames, repeat, 1); });
+    t0.join();
+    t1.join();
+    printf("Ring:%u frames:%zu repeat:%u failed:%u\n", JD_MT_QUEUE, frames.size(), repeat, failed[0] + failed[1]);
+
+    handoff(frames, repeat);
+    return (failed[0] + failed[1]) ? 1 : 0;
+}
@@ -0,0 +1,91 @@
+// M5GFX on the host (Subset used by this project)
+// The panel is a frame buffer, pushImageDMA copies the image immediately.
+#ifndef HOST_M5GFX_H
+#define HOST_M5GFX_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+namespace lgfx
+{
+struct swap565_t { uint16_t raw; };
+enum class color_depth_t : uint16_t { rgb332_1Byte = 8, rgb565_2Byte = 16, rgb888_3Byte = 24 };
+}
+
+struct HostSerial
+{
+    template<typename... Args> void printf(const char* fmt, Args... args) { ::fprintf(stderr, fmt, args...); }
+    void println(const char* s) { ::fprintf(stderr, "%s\n", s); }
+};
+inline HostSerial Serial;
+
+class LovyanGFX
+{
+  public:
+    struct ColorConverter { uint8_t bytes{2}; };
+
+    LovyanGFX(const int32_t w = 320, const int32_t h = 240) : _width(w), _height(h), _frame((size_t)w * h) {}
+    virtual ~LovyanGFX() {}
+
+    int32_t width() const { return _width; }
+    int32_t height() const { return _height; }
+    ColorConverter* getColorConverter() { return &_cc; }
+
+    bool dmaBusy() { return false; }
+    void waitDMA() {}
+    void pushImageDMA(int32_t x, int32_t y, int32_t w, int32_t h, lgfx::swap565_t* data)
+    {
+        for(int32_t i = 0; i < h; ++i)
+        {
+            if(y + i < 0 || y + i >= _height) { continue; }
+            memcpy(&_frame[(y + i) * _width + x], data + i * w, std::min(w, _width - x) * sizeof(uint16_t));
+        }
+        ++_pushes;
+        _pushedPixels += (uint64_t)w * h;
+        if(_onPush) { _onPush(_arg, x, y, w, h); }
+    }
+
+    // For the host tools
+    const uint16_t* frame() const { return _frame.data(); }
+    uint32_t pushes() const { return _pushes; }
+    uint64_t pushedPixels() const { return _pushedPixels; }
+    void setOnPush(void(*func)(void*, int32_t, int32_t, int32_t, int32_t), void* arg) { _onPush = func; _arg = arg; }
+
+  protected:
+    int32_t _width{}, _height{};
+    ColorConverter _cc{};
+    std::vector<uint16_t> _frame{};
+    uint32_t _pushes{};
+    uint64_t _pushedPixels{};
+    void(*_onPush)(void*, int32_t, int32_t, int32_t, int32_t){};
+    void* _arg{};
+};
+
+class LGFX_Sprite : public LovyanGFX
+{
+  public:
+    explicit LGFX_Sprite(LovyanGFX* = nullptr) : LovyanGFX(0, 0) {}
+
+    void setColorDepth(const lgfx::color_depth_t d) { _depth = d; }
+    lgfx::color_depth_t getColorDepth() const { return _depth; }
+    void* createSprite(const int32_t w, const int32_t h)
+    {
+        _width = w;
+        _height = h;
+        _panel_sprite.buf.assign((size_t)w * h * ((uint16_t)_depth >> 3), 0);
+        return _panel_sprite.getBuffer();
+    }
+    void* getBuffer() { return _panel_sprite.getBuffer(); }
+
+  protected:
+    struct PanelSprite
+    {
+        std::vector<uint8_t> buf;
+        void* getBuffer() { return buf.data(); }
+    } _panel_sprite;
+    lgfx::color_depth_t _depth{lgfx::color_depth_t::rgb565_2Byte};
+};
+#endif
@@ -0,0 +1,14 @@
+// M5Unified on the host (Only the log)
+#ifndef HOST_M5UNIFIED_H
+#define HOST_M5UNIFIED_H
+
+#include <cstdio>
+#include <cassert> // Included by the framework on the device
+#include <M5GFX.h>
+
+#define M5_LOGE(fmt, ...) fprintf(stderr, "[E] " fmt "\n", ##__VA_ARGS__)
+#define M5_LOGW(fmt, ...) fprintf(stderr, "[W] " fmt "\n", ##__VA_ARGS__)
+#define M5_LOGI(fmt, ...) fprintf(stderr, "[I] " fmt "\n", ##__VA_ARGS__)
+#define M5_LOGD(fmt, ...) /* nop */
+#define M5_LOGV(fmt, ...) /* nop */
+#endif
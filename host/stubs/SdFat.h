@@ -0,0 +1,26 @@
+// SdFat on the host (FsFile on the stdio)
+#ifndef HOST_SDFAT_H
+#define HOST_SDFAT_H
+
+#include <cstdint>
+#include <cstdio>
+#include "WString.h"
+
+class FsFile
+{
+  public:
+    FsFile() = default;
+    FsFile(const FsFile&) = delete;
+    FsFile& operator=(const FsFile&) = delete;
+    ~FsFile() { close(); }
+    bool open(const char* path) { close(); _fp = fopen(path, "rb"); return _fp != nullptr; }
+    void close() { if(_fp) { fclose(_fp); _fp = nullptr; } }
+    explicit operator bool() const { return _fp != nullptr; }
+    int read(void* buf, size_t len) { return _fp ? (int)fread(buf, 1, len, _fp) : -1; }
+    uint64_t position() { return _fp ? ftell(_fp) : 0; }
+    bool seek(uint64_t pos) { return _fp && fseek(_fp, (long)pos, SEEK_SET) == 0; }
+
+  private:
+    FILE* _fp{};
+};
+#endif
@@ -0,0 +1,13 @@
+// Arduino String on the host (Subset used by this project)
+#ifndef HOST_WSTRING_H
+#define HOST_WSTRING_H
+
+#include <string>
+
+class String : public std::string
+{
+  public:
+    String(const char* s = "") : std::string(s) {}
+    String(const std::string& s) : std::string(s) {}
+};
+#endif
@@ -0,0 +1,20 @@
+// ESP-IDF on the host (Subset used by this project)
+#ifndef HOST_ESP_HEAP_CAPS_H
+#define HOST_ESP_HEAP_CAPS_H
+
+#include <cstddef>
+#include <cstdlib>
+
+#define MALLOC_CAP_DMA (1 << 3)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+// Assume the free DMA capable memory of ESP32 after the setup of the player
+#ifndef HOST_FREE_DMA
+# define HOST_FREE_DMA (100 * 1024)
+#endif
+
+inline size_t heap_caps_get_free_size(int) { return HOST_FREE_DMA; }
+inline size_t heap_caps_get_largest_free_block(int) { return HOST_FREE_DMA; }
+inline void* heap_caps_malloc(size_t sz, int) { return malloc(sz); }
+inline void heap_caps_free(void* p) { free(p); }
+#endif
@@ -0,0 +1,43 @@
+// FreeRTOS on the host (Subset used by this project, tasks are std::thread)
+#ifndef HOST_FREERTOS_H
+#define HOST_FREERTOS_H
+
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define portMAX_DELAY (0xFFFFFFFFU)
+#define pdPASS (1)
+#define pdFAIL (0)
+#define pdTRUE (1)
+#define pdFALSE (0)
+#define portTICK_PERIOD_MS (1)
+#define pdMS_TO_TICKS(ms) (ms)
+#define portNUM_PROCESSORS (2)
+
+struct portMUX_TYPE { std::recursive_mutex m; };
+#define portMUX_INITIALIZER_UNLOCKED {}
+inline void portENTER_CRITICAL(portMUX_TYPE* p) { p->m.lock(); }
+inline void portEXIT_CRITICAL(portMUX_TYPE* p) { p->m.unlock(); }
+
+namespace host_rtos
+{
+template<class Pred> inline bool wait_for(std::unique_lock<std::mutex>& lk, std::condition_variable& cv, const TickType_t t, Pred pred)
+{
+    if(t == portMAX_DELAY) { cv.wait(lk, pred); return true; }
+    return cv.wait_for(lk, std::chrono::milliseconds(t), pred);
+}
+inline TickType_t ticks()
+{
+    static const auto t0 = std::chrono::steady_clock::now();
+    return (TickType_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+}
+}
+#endif
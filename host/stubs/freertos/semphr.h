@@ -0,0 +1,40 @@
+// FreeRTOS on the host (Subset used by this project)
+#ifndef HOST_FREERTOS_SEMPHR_H
+#define HOST_FREERTOS_SEMPHR_H
+
+#include "FreeRTOS.h"
+
+struct host_semaphore
+{
+    std::mutex m;
+    std::condition_variable cv;
+    unsigned count{}, max{};
+};
+typedef host_semaphore* SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateCounting(const UBaseType_t mx, const UBaseType_t init)
+{
+    auto s = new host_semaphore;
+    s->count = init;
+    s->max = mx;
+    return s;
+}
+inline SemaphoreHandle_t xSemaphoreCreateMutex() { return xSemaphoreCreateCounting(1, 1); }
+inline SemaphoreHandle_t xSemaphoreCreateBinary() { return xSemaphoreCreateCounting(1, 0); }
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t s, const TickType_t wait)
+{
+    std::unique_lock<std::mutex> lk(s->m);
+    if(!host_rtos::wait_for(lk, s->cv, wait, [&] { return s->count > 0; })) { return pdFALSE; }
+    --s->count;
+    return pdTRUE;
+}
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t s)
+{
+    std::lock_guard<std::mutex> lk(s->m);
+    if(s->count >= s->max) { return pdFALSE; }
+    ++s->count;
+    s->cv.notify_all();
+    return pdTRUE;
+}
+inline void vSemaphoreDelete(SemaphoreHandle_t s) { delete s; }
+#endif
@@ -0,0 +1,62 @@
+// FreeRTOS on the host (Subset used by this project, tasks are std::thread)
+#ifndef HOST_FREERTOS_TASK_H
+#define HOST_FREERTOS_TASK_H
+
+#include "FreeRTOS.h"
+
+struct host_task
+{
+    std::mutex m;
+    std::condition_variable cv;
+    uint32_t notify{};
+    const char* name{"loopTask"};
+    BaseType_t core{1};
+};
+typedef host_task* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+
+namespace host_rtos
+{
+struct task_exit {};
+inline thread_local host_task* current = nullptr;
+inline host_task main_task;
+inline host_task* self() { return current ? current : &main_task; }
+}
+
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t func, const char* name, uint32_t, void* arg, UBaseType_t, TaskHandle_t* handle, BaseType_t core)
+{
+    auto t = new host_task;
+    t->name = name;
+    t->core = core;
+    if(handle) { *handle = t; }
+    std::thread([=] {
+        host_rtos::current = t;
+        try { func(arg); } catch(host_rtos::task_exit&) {}
+    }).detach();
+    return pdPASS;
+}
+// The task object is leaked, the handle may be compared after the deletion
+inline void vTaskDelete(TaskHandle_t t) { if(!t || t == host_rtos::current) { throw host_rtos::task_exit{}; } }
+inline void vTaskDelay(const TickType_t t) { std::this_thread::sleep_for(std::chrono::milliseconds(t)); }
+inline void taskYIELD() { std::this_thread::yield(); }
+inline TickType_t xTaskGetTickCount() { return host_rtos::ticks(); }
+inline BaseType_t xPortGetCoreID() { return host_rtos::self()->core; }
+inline char* pcTaskGetTaskName(TaskHandle_t t) { return (char*)(t ? t : host_rtos::self())->name; }
+
+inline BaseType_t xTaskNotifyGive(TaskHandle_t t)
+{
+    std::lock_guard<std::mutex> lk(t->m);
+    ++t->notify;
+    t->cv.notify_all();
+    return pdPASS;
+}
+inline uint32_t ulTaskNotifyTake(const BaseType_t clear, const TickType_t wait)
+{
+    auto t = host_rtos::self();
+    std::unique_lock<std::mutex> lk(t->m);
+    if(!host_rtos::wait_for(lk, t->cv, wait, [&] { return t->notify > 0; })) { return 0; }
+    uint32_t v = t->notify;
+    t->notify = clear ? 0 : v - 1;
+    return v;
+}
+#endif
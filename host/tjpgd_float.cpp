@@ -0,0 +1,53 @@
+/*
+  TJpgD with the float YCbCr to RGB conversion (JD_FIXEDCOLOR 0) for jpg_bench
+  Renamed to TJpgDFloat, so it is linked with TJpgD of the fixed-point conversion.
+*/
+#define JD_FIXEDCOLOR 0
+#define TJpgD TJpgDFloat
+// Globals of tjpgdClass.cpp
+#define prof0 float_prof0
+#define prof1 float_prof1
+#define prof2 float_prof2
+#define prof3 float_prof3
+#define prof4 float_prof4
+#define prof5 float_prof5
+#define prof6 float_prof6
+#define prof7 float_prof7
+#include "../src/tjpgdClass.cpp"
+#include <vector>
+
+namespace
+{
+struct Output
+{
+    uint32_t width;
+    std::vector<uint8_t>* rgb;
+};
+
+uint32_t rgbOutput(TJpgD* jd, void* bitmap, TJpgD::JRECT* rect)
+{
+    auto out = (Output*)jd->device;
+    const uint8_t* src = (const uint8_t*)bitmap;
+    uint32_t w = rect->right - rect->left + 1;
+    for(int32_t y = rect->top; y <= rect->bottom; ++y)
+    {
+        memcpy(&(*out->rgb)[(y * out->width + rect->left) * 3], src, w * 3);
+        src += w * 3;
+    }
+    return 1;
+}
+//
+}
+
+// Decode to RGB888 at 1/1 with the float conversion
+bool decodeFloatColor(const uint8_t* data, const uint32_t size, uint32_t& width, uint32_t& height, std::vector<uint8_t>& rgb)
+{
+    TJpgD jd{};
+    Output out{ 0, &rgb };
+    jd.format = TJpgD::JDF_RGB888;
+    if(jd.prepare(data, size, &out) != TJpgD::JDR_OK) { return false; }
+    out.width = width = jd.width;
+    height = jd.height;
+    rgb.assign(width * height * 3, 0);
+    return jd.decomp(rgbOutput) == TJpgD::JDR_OK;
+}
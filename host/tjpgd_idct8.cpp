@@ -0,0 +1,23 @@
+/*
+  TJpgD without the dispatch of the IDCT (JD_IDCTDISPATCH 0) for jpg_bench
+  Renamed to TJpgDIdct8, so it is linked with TJpgD of the dispatch.
+*/
+#define JD_IDCTDISPATCH 0
+#define TJpgD TJpgDIdct8
+// Globals of tjpgdClass.cpp
+#define prof0 idct8_prof0
+#define prof1 idct8_prof1
+#define prof2 idct8_prof2
+#define prof3 idct8_prof3
+#define prof4 idct8_prof4
+#define prof5 idct8_prof5
+#define prof6 idct8_prof6
+#define prof7 idct8_prof7
+#include "../src/tjpgdClass.cpp"
+#include "mcu_walk.hpp"
+
+// Time (ns) of mcu_load with block_idct<8> for all the blocks
+double mcuLoadIdct8Ns(const uint8_t* data, const uint32_t size)
+{
+    return mcuLoadNs(data, size);
+}
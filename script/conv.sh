@@ -9,14 +9,20 @@
 #  convert (ImageMagick)
 #  ffmpeg-normalize
 #  gmv.py (Written by GOB)
+#  jpegtran (libjpeg-turbo) or Pillow if restart_interval is specified
+#
+# If gmv_mux (host/) is in PATH or GMV_MUX is set, the frames are streamed to it
+# instead of the temporary JPEG files, convert and gmv.py.
+# GMV_MUX_OPTS is passed to it. e.g. GMV_MUX_OPTS="-b 200000" keeps the sustained read rate 200000 bytes/s
 #
 
 # Check arguments
-if [ $# -lt 2 ] || [ $# -gt 3 ];then
-   echo "Usage: $0 movie_file_path frame_rate [jpeg_maximum_size]"
+if [ $# -lt 2 ] || [ $# -gt 4 ];then
+   echo "Usage: $0 movie_file_path frame_rate [jpeg_maximum_size] [restart_interval]"
    echo "  movie_file_path (File that FFmpeg can handle)"
    echo "  frame_rate 1.0 ~ 30.0 (Floating-point number)"
    echo "  jpeg_maximum_size 1024 - 10240 (7168 as default)"
+   echo "  restart_interval 0 - 255 MCUs (0 as default, no restart marker)"
    exit 1
 fi
 
@@ -45,6 +51,39 @@ if [ $JPEGSIZE -lt 1024 ] || [ $JPEGSIZE -gt 10240 ];then
 fi
 #echo "jpeg_maximum_size is $JPEGSIZE"
 
+# Exists and valid $4?
+if [ -n "$4" ] && [[ $4 =~ ^[0-9]+$ ]];then
+   RESTART=$4
+else
+   RESTART=0
+fi
+if [ $RESTART -gt 255 ];then
+   echo "Invalid restart_interval range (0 - 255)"
+   exit 1
+fi
+# Leave room for the restart markers that are inserted by gmv.py
+EXTENT=$JPEGSIZE
+if [ $RESTART -gt 0 ];then
+   EXTENT=$((JPEGSIZE - 256))
+fi
+
+# Make 8bit 8K mono wav and normalize
+ffmpeg -i $1 -ac 1 -ar 8000 -acodec pcm_u8 -y ${1%.*}.wav
+ffmpeg-normalize ${1%.*}.wav --audio-codec pcm_u8 --sample-rate 8000 -f -o ${1%.*}.wav
+# Make 16bit 22.05K streo wav and normalize
+#ffmpeg -i $1 -ac 2 -ar 22050 -acodec pcm_s16le -y ${1%.*}.wav
+#ffmpeg-normalize ${1%.*}.wav --audio-codec pcm_s16le --sample-rate 22050 -f -o ${1%.*}.wav
+
+# Stream MJPEG to gmv_mux (Oversized frames are re-encoded at the highest quality that fits)
+GMV_MUX=${GMV_MUX:-$(command -v gmv_mux)}
+if [ -n "$GMV_MUX" ];then
+   ffmpeg -i $1 -vf scale=320:-1,dejudder,framerate=$2 -qmin 1 -q 1 -f mjpeg - | \
+       "$GMV_MUX" -s $JPEGSIZE -r $RESTART $GMV_MUX_OPTS ${1%.*}.wav $2 ${1%.*}.gmv
+   result=$?
+   rm ${1%.*}.wav
+   exit $result
+fi
+
 # Output JPEG images from movie.
 rm -rf jpg$$
 mkdir jpg$$
@@ -65,20 +104,13 @@ ffmpeg -i $1 -vf scale=320:-1,dejudder,framerate=$2 -qmin 1 -q 1 jpg$$/%06d.jpg
 for fname in jpg$$/*.jpg
 do
     size=$(wc -c < $fname)
-    if [ $size -gt $JPEGSIZE ]; then
-	convert  $fname -define jpeg:extent=$JPEGSIZE $fname
+    if [ $size -gt $EXTENT ]; then
+	convert  $fname -define jpeg:extent=$EXTENT $fname
     fi
 done
 
-# Make 8bit 8K mono wav and normalize
-ffmpeg -i $1 -ac 1 -ar 8000 -acodec pcm_u8 -y ${1%.*}.wav
-ffmpeg-normalize ${1%.*}.wav --audio-codec pcm_u8 --sample-rate 8000 -f -o ${1%.*}.wav
-# Make 16bit 22.05K streo wav and normalize
-#ffmpeg -i $1 -ac 2 -ar 22050 -acodec pcm_s16le -y ${1%.*}.wav
-#ffmpeg-normalize ${1%.*}.wav --audio-codec pcm_s16le --sample-rate 22050 -f -o ${1%.*}.wav
-
 # Combine JPEG files and wave file
-python gmv.py jpg$$ ${1%.*}.wav $2 ${1%.*}.gmv
+python gmv.py jpg$$ ${1%.*}.wav $2 ${1%.*}.gmv --restart $RESTART
 
 #Cleanup
 rm -rf jpg$$
@@ -4,6 +4,9 @@
 #
 import os
 import sys
+import io
+import shutil
+import subprocess
 import argparse
 import glob
 from ctypes import *
@@ -62,12 +65,21 @@ class GMV0(LittleEndianStructure):
         ('gcfOffset', c_uint32),
         ('fps', c_float),
         ]
-    def __init__(self, blks = 0, fps = 1.0):
-        self.signature = 0x30564d47 # "GMV0"
+    def __init__(self, blks = 0, fps = 1.0, index = False):
+        self.signature = 0x31564d47 if index else 0x30564d47 # "GMV1" (with index) or "GMV0"
         self.blocks = blks
-        self.gcfOffset = sizeof(GMV0) + sizeof(WaveHeader)
+        self.gcfOffset = sizeof(GMV0) + sizeof(WaveHeader) + (sizeof(GMVIndex) if index else 0)
         self.fps = fps
 
+# Follows GMV0 header and wav header if signature is "GMV1"
+class GMVIndex(LittleEndianStructure):
+    _pack_ = 1
+    _fields_ = [
+        ('offset', c_uint32), # Offset of the block offset table (uint32_t * blocks)
+        ]
+    def __init__(self, offset = 0):
+        self.offset = offset
+
 def loadWav(fname):
     wh = WaveHeader()
     sub = SubChunk()
@@ -87,6 +99,18 @@ def loadWav(fname):
 
     return wh, sub, data
         
+# Insert restart markers every interval MCUs
+# jpegtran rewrites the entropy-coded data losslessly. Pillow re-encodes with the same quantization tables if jpegtran is not found.
+def addRestart(data, interval):
+    if shutil.which('jpegtran'):
+        return subprocess.run(['jpegtran', '-copy', 'none', '-restart', '{}B'.format(interval)],
+                              input=data, stdout=subprocess.PIPE, check=True).stdout
+    from PIL import Image
+    with Image.open(io.BytesIO(data)) as img:
+        out = io.BytesIO()
+        img.save(out, 'JPEG', quality='keep', subsampling='keep', restart_marker_blocks=interval)
+        return out.getvalue()
+
 def main():
     parser = argparse.ArgumentParser(description='Create GMV file from JPEG files and wav file')
     parser.add_argument('dirname', help='Target image directory')
@@ -94,6 +118,8 @@ def main():
     parser.add_argument('fps', type=float, help='Base frame per second')
     parser.add_argument('outfile', help='Output filename')
     parser.add_argument('--ext', '-e', type=str, default='jpg', help='Target image file extension')
+    parser.add_argument('--noindex', action='store_true', help='Output without block index (GMV0)')
+    parser.add_argument('--restart', '-r', type=int, default=0, help='Restart interval in MCUs (0: as it is). Dividing the MCU row into 2 or more lets the player decode them on both cores')
     parser.add_argument('--verbose', '-v', action='store_true')
     args = parser.parse_args()
 
@@ -125,15 +151,21 @@ def main():
     # Output GMV
     with open(args.outfile, 'wb') as outf:
         # GMV header
-        header = GMV0(files, args.fps)
+        header = GMV0(files, args.fps, not args.noindex)
         outf.write(header)
         outf.write(wh)
+        if not args.noindex:
+            outf.write(GMVIndex()) # Rewrite later
+        offsets = []
 
         # Image and wav block
         for name in fileList:
+            offsets.append(outf.tell())
             # Read imgae block
             with open(name, 'rb') as inf:
                 d = inf.read()
+                if args.restart > 0:
+                    d = addRestart(d, args.restart)
                 sz = len(d)
                 # image size
                 outf.write(struct.pack('<L', sz))
@@ -158,6 +190,13 @@ def main():
                 
         outf.write(struct.pack('<L', 0xFFFFFFFF)) 
         outf.write(struct.pack('<L', 0xFFFFFFFF)) 
+
+        # Block offset table
+        if not args.noindex:
+            index = GMVIndex(outf.tell())
+            outf.write(struct.pack('<{}L'.format(len(offsets)), *offsets))
+            outf.seek(sizeof(GMV0) + sizeof(WaveHeader))
+            outf.write(index)
         outf.flush();
         outf.close()
 
@@ -0,0 +1,87 @@
+#
+# Convert the trace dump in the serial log to Chrome trace_event JSON
+# trace.py log_path [output_path]
+# Build with -DENABLE_TRACE, the last events are dumped at the end of the file or on stop.
+# Open the output with chrome://tracing or https://ui.perfetto.dev
+#
+import sys
+import re
+import json
+import argparse
+
+# trace,<us>,<core>,<phase>,<task>,<name>
+LINE = re.compile(r'trace,(\d+),(\d+),([BEi]),([^,]*),([^,\s]+)')
+
+def parse(lines):
+    dumps = []
+    events = None
+    for line in lines:
+        if 'trace begin' in line:
+            events = []
+            continue
+        if 'trace end' in line:
+            if events is not None: dumps.append(events)
+            events = None
+            continue
+        m = LINE.search(line)
+        if m and events is not None:
+            events.append((int(m.group(1)), int(m.group(2)), m.group(3), m.group(4), m.group(5)))
+    return dumps
+
+def convert(events):
+    if not events: return []
+    # Timestamp is 32bit us (wraps), the base is the oldest head of the cores
+    heads = {}
+    for e in events: heads.setdefault(e[1], e[0])
+    base = min(heads.values(), key=lambda h: max((o - h) & 0xFFFFFFFF for o in heads.values()))
+
+    tids = {}
+    out = []
+    stacks = {}
+    last = 0
+    for at, core, ph, task, name in events:
+        ts = (at - base) & 0xFFFFFFFF
+        last = max(last, ts)
+        key = (task, core)
+        if key not in tids:
+            tids[key] = len(tids) + 1
+            out.append({'name': 'thread_name', 'ph': 'M', 'pid': 0, 'tid': tids[key],
+                        'args': {'name': '{} (core {})'.format(task, core)}})
+        tid = tids[key]
+        st = stacks.setdefault(tid, [])
+        ev = {'name': name, 'ph': ph, 'ts': ts, 'pid': 0, 'tid': tid}
+        if ph == 'B':
+            st.append(name)
+        elif ph == 'E':
+            # The begin may have been overwritten in the ring
+            if name not in st: continue
+            while st and st.pop() != name: pass
+        else:
+            ev['s'] = 't'
+        out.append(ev)
+    # Close the spans still open at the dump
+    for tid, st in stacks.items():
+        for name in reversed(st):
+            out.append({'name': name, 'ph': 'E', 'ts': last, 'pid': 0, 'tid': tid})
+    return out
+
+def main():
+    parser = argparse.ArgumentParser(description='Convert the trace dump in the serial log to Chrome trace_event JSON')
+    parser.add_argument('logfile', help='Serial log that includes the trace dump')
+    parser.add_argument('outfile', nargs='?', default='trace.json', help='Output filename')
+    parser.add_argument('--index', '-i', type=int, default=-1, help='Which dump to convert if the log has several (default: the last)')
+    args = parser.parse_args()
+
+    with open(args.logfile, errors='replace') as f:
+        dumps = parse(f)
+    if not dumps:
+        print('Trace dump not found', file=sys.stderr)
+        return 1
+    events = convert(dumps[args.index])
+    with open(args.outfile, 'w') as f:
+        json.dump({'traceEvents': events, 'displayTimeUnit': 'ms'}, f)
+    print('{} events ({} dumps in the log) => {}'.format(len(events), len(dumps), args.outfile))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -6,10 +6,11 @@
 #include <SdFat.h>
 #include <M5Unified.h> // For Log
 #include "MainClass.h"
+#include "scoped_profiler.hpp"
 
 #pragma GCC optimize ("O3")
 
-bool MainClass::setup(LovyanGFX* lcd)
+bool MainClass::setup(LovyanGFX* lcd, uint8_t bands, uint16_t lines)
 {
     _lcd = lcd;
     _lcd_width = lcd->width();
@@ -19,31 +20,78 @@ bool MainClass::setup(LovyanGFX* lcd)
             ? jpgWrite16
             : jpgWrite24
             ;
-    for (int i = 0; i < buf_count; ++i)
+    // Decoder outputs swap565 directly for 16bit color panel
+    _jdec.format = (_bytesize == 2) ? TJpgD::JDF_SWAP565 : TJpgD::JDF_RGB888;
+
+    // Choose the band height and the number of bands from the free DMA capable heap if not specified
+    const size_t line_size = _lcd_width * _bytesize;
+    const size_t free_size = heap_caps_get_free_size(MALLOC_CAP_DMA);
+    const size_t budget = (free_size > dma_reserve) ? free_size - dma_reserve : 0;
+    if (!lines)
+    {
+        lines = default_band_lines;
+        while (lines > mcu_lines && budget < line_size * lines * 2) { lines -= mcu_lines; }
+    }
+    lines = std::max<uint16_t>(mcu_lines, lines / mcu_lines * mcu_lines); // Whole MCU rows
+    if (!bands)
+    {
+        bands = std::min<size_t>(std::max<size_t>(budget / (line_size * lines), 2), max_bands);
+    }
+    bands = std::min<uint8_t>(std::max<uint8_t>(bands, 2), max_bands);
+
+    _band_count = 0;
+    while (_band_count < bands)
     {
-        _dmabufs[i] = (uint8_t*)heap_caps_malloc(_lcd_width * 48 * _bytesize, MALLOC_CAP_DMA);
-        assert(_dmabufs[i]);
+        _dmabufs[_band_count] = (uint8_t*)heap_caps_malloc(line_size * lines, MALLOC_CAP_DMA);
+        if (!_dmabufs[_band_count]) { break; }
+        ++_band_count;
     }
+    if (_band_count < 2)
+    {
+        M5_LOGE("Failed to allocate bands %u lines:%u", bands, lines);
+        return false;
+    }
+    _band_lines = lines;
     _dmabuf = _dmabufs[0];
+    _queued = _issued = 0;
+    M5_LOGI("Bands:%u lines:%u free DMA:%u", _band_count, _band_lines, free_size);
 
-    _jdec.multitask_begin();
+    if (!_jdec.multitask_begin())
+    {
+        M5_LOGE("multitask_begin failed"); // decomp_multitask falls back to decomp
+    }
+    _done = xSemaphoreCreateBinary();
+    _pushLock = xSemaphoreCreateMutex();
+    assert(_done && _pushLock);
     _busy = false;
     return true;
 }
 
 bool MainClass::drawJpg(const uint8_t* buf, int32_t len, const bool multi)
 {
-    _filebuf = buf;
-    _fileindex = 0;
-    _remain = len;
-    TJpgD::JRESULT jres = _jdec.prepare(jpgRead, this);
+    // The output task may be still writing the last band of the previous image.
+    // The DMA of it can go on, the first band of this image is pushed after it.
+    waitOutput();
+
+    TJpgD::JRESULT jres = _jdec.prepare(buf, len, this); // Decode directly from buf
     if (jres != TJpgD::JDR_OK) {
         M5_LOGE("prepare failed! %d", jres);
         return false;
     }
 
-    _out_width = std::min<int32_t>(_jdec.width, _lcd_width);
-    _jpg_x = (_lcd_width - _jdec.width) >> 1;
+    // Decode at reduced size (1/2, 1/4, 1/8) while the result still covers the width or height of the LCD
+    uint8_t scale = 0;
+    while (_autoScale && scale < 3 &&
+           ((_jdec.width >> (scale + 1)) >= _lcd_width || (_jdec.height >> (scale + 1)) >= _lcd_height))
+    {
+        ++scale;
+    }
+    _jdec.scale = scale;
+    const int32_t jpg_width = _jdec.scaled_width();
+    const int32_t jpg_height = _jdec.scaled_height();
+
+    _out_width = std::min<int32_t>(jpg_width, _lcd_width);
+    _jpg_x = (_lcd_width - jpg_width) >> 1;
     if (0 > _jpg_x) {
         _off_x = - _jpg_x;
         _jpg_x = 0;
@@ -51,18 +99,25 @@ bool MainClass::drawJpg(const uint8_t* buf, int32_t len, const bool multi)
         _off_x = 0;
     }
 
-    _out_height = std::min<int32_t>(_jdec.height, _lcd_height);
-    _jpg_y = (_lcd_height- _jdec.height) >> 1;
+    _out_height = std::min<int32_t>(jpg_height, _lcd_height);
+    _jpg_y = (_lcd_height- jpg_height) >> 1;
     if (0 > _jpg_y) {
         _off_y = - _jpg_y;
         _jpg_y = 0;
     } else {
         _off_y = 0;
     }
-    //M5_LOGI("j(%d,%d) o(%d,%d) j:[%d,%d] out[%d,%d]", _jpg_x, _jpg_y, _off_x, _off_y, _jdec.width, _jdec.height, _out_width, _out_height);
+    //M5_LOGI("j(%d,%d) o(%d,%d) j:[%d,%d] out[%d,%d]", _jpg_x, _jpg_y, _off_x, _off_y, jpg_width, jpg_height, _out_width, _out_height);
+    // MCUs out of the LCD are not decoded
+    _jdec.set_viewport(_off_x, _off_y, _out_width, _out_height);
+
+    // Several MCU rows in a band (MCU rows are 1/scale of 8 or 16 lines)
+    const uint32_t mcu_height = std::max(1, (_jdec.msy * 8) >> scale);
+    const uint32_t lineskip = std::max<uint32_t>(_band_lines / mcu_height, 1) - 1;
+    _band_top = 0;
 
     _busy = true;
-    jres = multi ? _jdec.decomp_multitask(_fp_jpgWrite, jpgWriteRow) :  _jdec.decomp(_fp_jpgWrite, jpgWriteRow);
+    jres = multi ? _jdec.decomp_multitask(_fp_jpgWrite, jpgWriteRow, lineskip) :  _jdec.decomp(_fp_jpgWrite, jpgWriteRow, lineskip);
 
     // If the value is 1 (JDR_INTR),
     // No problem because the process is stopped by myself.
@@ -70,21 +125,56 @@ bool MainClass::drawJpg(const uint8_t* buf, int32_t len, const bool multi)
     if (jres > TJpgD::JDR_INTR)
     {
         M5_LOGE("decomp failed! %d", jres);
+        finish(); // The rest of the bands never come
         return false;
     }
     //M5_LOGI("==>core:%u dma:%d", xPortGetCoreID(), _lcd && _lcd->dmaBusy());
     return true;
 }
 
-uint32_t MainClass::jpgRead(TJpgD *jdec, uint8_t *buf, uint32_t len) {
-    MainClass* me = (MainClass*)jdec->device;
-    if (len > me->_remain)  len = me->_remain;
-    if (buf) {
-        memcpy(buf, (const uint8_t *)me->_filebuf + me->_fileindex, len);
+void MainClass::wait()
+{
+    TraceScope("dma_wait");
+    waitOutput();
+    xSemaphoreTake(_pushLock, portMAX_DELAY);
+    while (_issued != _queued) { if (!push()) { taskYIELD(); } }
+    xSemaphoreGive(_pushLock);
+    _lcd->waitDMA(); // Only the last band remains
+}
+
+void MainClass::waitOutput()
+{
+    // Stale signal of the previous image is consumed by the loop
+    while (_busy) { xSemaphoreTake(_done, portMAX_DELAY); }
+}
+
+void MainClass::finish()
+{
+    _busy = false;
+    xSemaphoreGive(_done);
+}
+
+// Push the oldest written band if the DMA is idle (Call with _pushLock)
+bool MainClass::push()
+{
+    if (_issued == _queued || _lcd->dmaBusy()) { return false; }
+    const uint32_t idx = _issued % _band_count;
+    const auto& b = _bands[idx];
+    _lcd->pushImageDMA(b.x, b.y, b.w, b.h, reinterpret_cast<::lgfx::swap565_t*>(_dmabufs[idx]));
+    TraceInstant("dma_push");
+    ++_issued;
+    return true;
+}
+
+// Called from the writers, the band is pushed as soon as the DMA is idle
+void MainClass::tryPush()
+{
+    if (_issued == _queued || _lcd->dmaBusy()) { return; }
+    if (xSemaphoreTake(_pushLock, 0) == pdTRUE)
+    {
+        push();
+        xSemaphoreGive(_pushLock);
     }
-    me->_fileindex += len;
-    me->_remain -= len;
-    return len;
 }
 
 // for 24bit color panel
@@ -105,7 +195,7 @@ uint32_t MainClass::jpgWrite24(TJpgD *jdec, void *bitmap, TJpgD::JRECT *rect) {
     if (rect->right < me->_off_x)      return 1;
     if (x >= (me->_off_x + outWidth))  return 1;
     if (rect->bottom < me->_off_y)     return 1;
-    if (y >= (me->_off_y + outHeight)) { me->_busy = false; return 0; } // No more rendering. [*1] => decomp failed 1 (Interrupted by output function.
+    if (y >= (me->_off_y + outHeight)) { me->finish(); return 0; } // No more rendering. [*1] => decomp failed 1 (Interrupted by output function.
 
     int32_t src_idx = 0;
     int32_t dst_idx = 0;
@@ -124,7 +214,7 @@ uint32_t MainClass::jpgWrite24(TJpgD *jdec, void *bitmap, TJpgD::JRECT *rect) {
     }
 
     int_fast16_t line = (w - ( oL + oR )) * 3;
-    dst_idx += oL + x - me->_off_x;
+    dst_idx += oL + x - me->_off_x + me->bandRow(y) * outWidth;
     src_idx += oL;
     do {
         memcpy(&dst[dst_idx * 3], &src[src_idx * 3], line);
@@ -132,10 +222,11 @@ uint32_t MainClass::jpgWrite24(TJpgD *jdec, void *bitmap, TJpgD::JRECT *rect) {
         src_idx += w;
     } while (--h);
 
+    me->tryPush();
     return 1;
 }
 
-// for 16bit color panel
+// for 16bit color panel (bitmap is already swap565)
 uint32_t MainClass::jpgWrite16(TJpgD *jdec, void *bitmap, TJpgD::JRECT *rect) {
     MainClass* me = (MainClass*)jdec->device;
 
@@ -147,17 +238,17 @@ uint32_t MainClass::jpgWrite16(TJpgD *jdec, void *bitmap, TJpgD::JRECT *rect) {
     uint_fast16_t h = rect->bottom + 1 - y;
     uint_fast16_t outWidth = me->_out_width;
     uint_fast16_t outHeight = me->_out_height;
-    uint8_t *src = (uint8_t*)bitmap;
+    const uint16_t *src = (const uint16_t*)bitmap;
     uint_fast16_t oL = 0, oR = 0;
 
     if (rect->right < me->_off_x)      return 1;
     if (x >= (me->_off_x + outWidth))  return 1;
     if (rect->bottom < me->_off_y)     return 1;
-    if (y >= (me->_off_y + outHeight)) { me->_busy = false; return 0; } // No more rendering. [*1] => decomp failed 1 (Interrupted by output function.
+    if (y >= (me->_off_y + outHeight)) { me->finish(); return 0; } // No more rendering. [*1] => decomp failed 1 (Interrupted by output function.
         
     if (me->_off_y > y) {
         uint_fast16_t linesToSkip = me->_off_y - y;
-        src += linesToSkip * w * 3;
+        src += linesToSkip * w;
         h -= linesToSkip;
     }
 
@@ -167,71 +258,61 @@ uint32_t MainClass::jpgWrite16(TJpgD *jdec, void *bitmap, TJpgD::JRECT *rect) {
     if (rect->right >= (me->_off_x + outWidth)) {
         oR = (rect->right + 1) - (me->_off_x + outWidth);
     }
-    int_fast16_t line = (w - ( oL + oR ));
-    dst += oL + x - me->_off_x;
-    src += oL * 3;
+    int_fast16_t line = (w - ( oL + oR )) * sizeof(uint16_t);
+    dst += oL + x - me->_off_x + me->bandRow(y) * outWidth;
+    src += oL;
 
     do {
-        int i = 0;
-        do {
-#define ALGO (1)
-#if ALGO == 0
-            // Orignal
-            uint_fast8_t r8 = src[i*3+0] & 0xF8;
-            uint_fast8_t g8 = src[i*3+1];
-            uint_fast8_t b5 = src[i*3+2] >> 3;
-            r8 |= g8 >> 5;
-            g8 &= 0x1C;
-            b5 = (g8 << 3) + b5;
-            dst[i] = r8 | b5 << 8;
-#elif ALGO == 1
-            // Modified (Just a little faster than the original)
-            uint32_t r = src[i*3+0] & 0xF8;
-            uint32_t g = src[i*3+1] >> 2;
-            uint32_t b = src[i*3+2] >> 3;
-            r +=  (g >> 3);
-            b +=  (g << 5);
-            dst[i] = r | b << 8;
-#else
-#error "No code"
-#endif
-        } while (++i != line);
+        memcpy(dst, src, line);
         dst += outWidth;
-        src += w * 3;
+        src += w;
     } while (--h);
+
+    me->tryPush();
     return 1;
 }
 
 uint32_t MainClass::jpgWriteRow(TJpgD *jdec, uint32_t y, uint32_t h) {
-    static int flip = 0;
     MainClass* me = (MainClass*)jdec->device;
-    int_fast16_t oy = me->_off_y;
-    int_fast16_t bottom = y + h;
-    int_fast16_t yy = y;
-    
-    if(bottom < oy) { return 1; /* continue */ }
-    if(y >= oy + me->_lcd_height) { me->_busy = false; return 0; /* cutoff [*1] */}
+    const int32_t out_bottom = me->_off_y + me->_out_height;
+    const int32_t top = std::max<int32_t>(y, me->_off_y);
+    const int32_t bottom = std::min<int32_t>(y + h, out_bottom);
+    me->_band_top = y + h; // Top of the next band
+
+    if(bottom <= top)
+    {
+        if((int32_t)y >= out_bottom) { me->finish(); return 0; /* cutoff [*1] */ }
+        return 1; /* continue */
+    }
 
     //M5_LOGI("core:%u dma:%d y:%d, h:%d", xPortGetCoreID(), me->_lcd && me->_lcd->dmaBusy(), y, h);
+    xSemaphoreTake(me->_pushLock, portMAX_DELAY);
+    const uint32_t n = me->_band_count;
+    me->_bands[me->_queued % n] = { me->_jpg_x, me->_jpg_y + top - me->_off_y, me->_out_width, bottom - top };
+    ++me->_queued;
 
-    // Adjust transfer height if there is a positive offset in the y direction
-    if(oy > 0)
+    // Wait until the buffer of the next band is pushed and its DMA is completed.
+    // The decoder can run up to (bands - 1) ahead of the DMA.
     {
-        yy = y - oy;
-        if(oy > y && oy < bottom) { h -= oy % h; yy = 0; } // First block
-        if(oy + me->_lcd_height > y && oy + me->_lcd_height < y + h) // Last block
+        TraceScope("band_wait");
+        for(;;)
         {
-            h -= (y + h) - (me->_lcd_height + oy);
-        } 
+            me->push();
+            uint32_t pending = me->_queued - me->_issued;
+            if(pending + 1 < n || (pending + 1 == n && !me->_lcd->dmaBusy())) { break; }
+            taskYIELD();
+        }
     }
-    //M5_LOGI("oy:%d y:%d h:%d yy:%d", oy, y, h, yy);
-    me->_lcd->pushImageDMA(me->_jpg_x,  me->_jpg_y + yy,
-                           me->_out_width, h,
-                           reinterpret_cast<::lgfx::swap565_t*>(me->_dmabuf));
-
-    flip = !flip;
-    me->_dmabuf = me->_dmabufs[flip];
+    me->_dmabuf = me->_dmabufs[me->_queued % n];
 
-    if(y + h >= (me->_off_y + me->_out_height)) { me->_busy = false; }
+    if(bottom >= out_bottom)
+    {
+        // Push the rest of this image
+        while(me->_issued != me->_queued) { if(!me->push()) { taskYIELD(); } }
+        xSemaphoreGive(me->_pushLock);
+        me->finish();
+        return 1;
+    }
+    xSemaphoreGive(me->_pushLock);
     return 1;
 }
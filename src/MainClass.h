@@ -7,31 +7,54 @@
 #define _MAINCLASS_H_
 
 #include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
 #include <M5GFX.h>
 #include "tjpgdClass.h"
+#include <algorithm>
 
 // Decode jpg and push to diaplay with DMA.
 class MainClass
 {
   public:
-    bool setup(LovyanGFX* lcd);
+    // bands, lines: Number of the band buffers and the lines of each band (0: Choose from the free DMA capable heap)
+    bool setup(LovyanGFX* lcd, uint8_t bands = 0, uint16_t lines = 0);
+    // It can be called while the DMA of the previous image is in progress (Keep the transaction of the LCD)
     bool drawJpg(const uint8_t* buf, int32_t len, const bool multi = true);
 
     // In rendering?
     bool isBusy() const { return _busy || (_lcd && _lcd->dmaBusy()); }
+    // Block until the last band is pushed and its DMA is completed
+    void wait();
+
+    // Decode at 1/2, 1/4, 1/8 if the image is larger than the LCD (default true)
+    void setAutoScale(const bool enable) { _autoScale = enable; }
+    // Scale of the last drawJpg (0:1/1, 1:1/2, 2:1/4, 3:1/8)
+    uint8_t scale() const { return _jdec.scale; }
+    uint8_t bands() const { return _band_count; }
+    uint16_t bandLines() const { return _band_lines; }
     
   private:
     LovyanGFX* _lcd{};
     uint_fast8_t _bytesize{};
 
-    static constexpr uint8_t buf_count = 2;
-    uint8_t* _dmabufs[buf_count];
-    uint8_t* _dmabuf{};
-    TJpgD _jdec{};
+    static constexpr uint8_t max_bands = 4;
+    static constexpr uint16_t mcu_lines = 16;              // Height of the largest MCU
+    static constexpr uint16_t default_band_lines = 48;
+    static constexpr size_t dma_reserve = 1024 * 48;       // Left for the others (Speaker, SD...)
 
-    int32_t _remain{};
-    const uint8_t* _filebuf{};
-    uint32_t _fileindex{};
+    // Ring of the bands. Written by the decoder, pushed with DMA in order
+    struct Band { int32_t x, y, w, h; };
+    uint8_t* _dmabufs[max_bands]{};
+    Band _bands[max_bands]{};
+    uint8_t* _dmabuf{};  // Buffer of the band in writing
+    uint8_t _band_count{};
+    uint16_t _band_lines{};
+    volatile uint32_t _queued{}, _issued{}; // Written and pushed bands (_issued - 1 may be in DMA)
+    int32_t _band_top{}; // Top line of the band in writing (scaled image coordinates)
+    SemaphoreHandle_t _pushLock{};
+    TJpgD _jdec{};
 
     int32_t _lcd_width{}, _lcd_height{};
     int32_t _out_width{}, _out_height{};
@@ -41,12 +64,24 @@ class MainClass
     using FpJpgWrite = uint32_t(*)(TJpgD*,void*,TJpgD::JRECT*);
     FpJpgWrite _fp_jpgWrite{};
 
-    static uint32_t jpgRead(TJpgD *jdec, uint8_t *buf, uint32_t len);
     static uint32_t jpgWrite24(TJpgD *jdec, void *bitmap, TJpgD::JRECT *rect);
     static uint32_t jpgWrite16(TJpgD *jdec, void *bitmap, TJpgD::JRECT *rect);
     static uint32_t jpgWriteRow(TJpgD *jdec, uint32_t y, uint32_t h);
 
-    bool _busy{};
+    // Signaled by finish() when the last band is pushed
+    void waitOutput();
+    void finish();
+    SemaphoreHandle_t _done{};
+
+    bool push();
+    void tryPush();
+    // Row in the band buffer of the line (Lines above _off_y are not written)
+    int32_t bandRow(const int32_t y) const { return std::max(y, _off_y) - std::max(_band_top, _off_y); }
+
+    volatile bool _busy{};
+    bool _autoScale{true};
+
+    friend struct MainClassProbe; // Host tools (host/main_class_probe.hpp)
 };
 
 #endif
@@ -0,0 +1,83 @@
+/*!
+  @file gob_av_clock.hpp
+  @brief Playback clock driven by the audio samples consumed by the speaker
+ */
+#ifndef GOB_AV_CLOCK_HPP
+#define GOB_AV_CLOCK_HPP
+
+#include <cstdint>
+#include <algorithm>
+#include "esp32_clock.hpp"
+
+namespace gob
+{
+
+/*!
+  @class AVClock
+  @brief Audio master clock
+  @note The speaker consumes byte_per_sec from the time the audio is queued to the empty queue.
+  Position is the elapsed time from that point, and never exceeds the queued audio.
+  If the file has no audio, it is the wall clock from the first frame.
+ */
+class AVClock
+{
+  public:
+    using time_point = ESP32Clock::time_point;
+
+    //! @brief Start the clip
+    void reset(const uint32_t bytePerSec, const float fps)
+    {
+        _bps = bytePerSec;
+        _frameUs = (fps > 0.0f) ? (int64_t)(1000000.0f / fps) : 0;
+        _fps = fps;
+        _started = _audio = false;
+        _queued = _anchorBytes = 0;
+    }
+
+    /*!
+      @brief Audio is queued to the speaker
+      @param bytes Size of the audio
+      @param underrun The queue of the speaker was empty (Audio restarts from now)
+     */
+    void pushAudio(const uint32_t bytes, const bool underrun, const time_point& now)
+    {
+        if(!bytes || !_bps) { return; }
+        if(!_audio || underrun)
+        {
+            _anchor = now;
+            _anchorBytes = _queued;
+            _started = _audio = true;
+        }
+        _queued += bytes;
+    }
+
+    //! @brief Playback position (us)
+    int64_t position(const time_point& now)
+    {
+        if(!_started) { _anchor = now; _started = true; } // Wall clock from the first frame
+        int64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - _anchor).count();
+        if(!_audio) { return elapsed; }
+        return std::min(toUs(_anchorBytes) + elapsed, toUs(_queued));
+    }
+
+    //! @brief Presentation time of the frame (us)
+    int64_t presentation(const uint32_t frame) const
+    {
+        return (_fps > 0.0f) ? (int64_t)(frame * 1000000.0 / _fps) : 0;
+    }
+    //! @brief Duration of the frame (us)
+    int64_t frameDuration() const { return _frameUs; }
+
+  private:
+    int64_t toUs(const uint64_t bytes) const { return (int64_t)(bytes * 1000000ULL / _bps); }
+
+    uint32_t _bps{};
+    float _fps{};
+    int64_t _frameUs{};
+    bool _started{}, _audio{};
+    uint64_t _queued{}, _anchorBytes{};
+    time_point _anchor{};
+};
+//
+}
+#endif
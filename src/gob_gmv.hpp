@@ -37,13 +37,27 @@ struct __attribute__((packed)) sub_chunk_t
  */
 struct __attribute__((packed)) GMVHeader
 {
-    static constexpr uint32_t Signature = 0x30564d47;
+    static constexpr uint32_t Signature = 0x30564d47;          //!< @brief "GMV0"
+    static constexpr uint32_t SignatureWithIndex = 0x31564d47; //!< @brief "GMV1" (Followed by GMVIndex)
 
-    uint32_t signature{}; //!< @brief Signature "GMV0" 0x30564d47
+    uint32_t signature{}; //!< @brief Signature "GMV0" 0x30564d47 or "GMV1" 0x31564d47
     uint32_t blocks{};    //!< @brief Number of the data blocks
     uint32_t gcfOffset{}; //!< @brief data block Offset from the beginning of the file
     float fps{};          //!< @brief Frame per second
     wav_header_t wavHeader{}; //!< @brief wav header
+
+    inline bool valid() const { return signature == Signature || signature == SignatureWithIndex; }
+    inline bool hasIndex() const { return signature == SignatureWithIndex; }
+};
+
+/*!
+  @struct GMVIndex
+  @brief Reference to the block offset table (GMV1 only, placed immediately after GMVHeader)
+  @note The table is uint32_t[blocks], each is block offset from the beginning of the file
+ */
+struct __attribute__((packed)) GMVIndex
+{
+    uint32_t offset{}; //!< @brief Offset of the table from the beginning of the file
 };
 
 /*!
@@ -23,20 +23,28 @@ class GMVFile
     float fps() const { return _header.fps; }
     uint32_t imageSize() const { return _size[0]; }
     uint32_t wavSize() const { return _size[1]; }
+    bool hasIndex() const { return _index.offset != 0; }
     
     bool open(const String& path) { return open(path.c_str()); }
     bool open(const char* path)
     {
         _header = {};
+        _index = {};
         _current = _blockHead = 0;
         close();
         
         if(!_file.open(path) ||
            _file.read(&_header, sizeof(_header)) != sizeof(_header) ||
-           _header.signature != GMVHeader::Signature)
+           !_header.valid())
         {
             return false;
         }
+        if(_header.hasIndex())
+        {
+            if(_file.read(&_index, sizeof(_index)) != sizeof(_index)) { return false; }
+            _blockHead = _header.gcfOffset;
+            return _file.seek(_blockHead);
+        }
         _blockHead = _file.position();
         return true;
     }
@@ -69,9 +77,40 @@ class GMVFile
         return _file ? _file.seek(_blockHead) : false;
     }
 
+    // Next readBlock() reads the specified block.
+    // O(1) if the file has index, otherwise skips block headers from the nearest known position.
+    bool seek(const uint32_t block)
+    {
+        if(!_file || block >= blocks()) { return false; }
+        if(hasIndex())
+        {
+            uint32_t offset{};
+            if(!_file.seek(_index.offset + block * sizeof(offset)) ||
+               _file.read(&offset, sizeof(offset)) != sizeof(offset) ||
+               !_file.seek(offset))
+            {
+                return false;
+            }
+            _current = block;
+            return true;
+        }
+        if(block < _current && !rewind()) { return false; }
+        while(_current < block)
+        {
+            if(_file.read(_size, sizeof(_size)) != sizeof(_size) ||
+               !_file.seek(_file.position() + _size[0] + _size[1]))
+            {
+                return false;
+            }
+            ++_current;
+        }
+        return true;
+    }
+
   private:
     FsFile _file{};
     GMVHeader _header{};
+    GMVIndex _index{};
     uint32_t _current{};
     uint32_t _blockHead{}; // Head of block
     uint32_t _size[2]; // 0:image 1:wav
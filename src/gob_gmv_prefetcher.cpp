@@ -0,0 +1,161 @@
+/*!
+  @file gob_gmv_prefetcher.cpp
+  @brief Read-ahead GMV blocks by the task on the other core
+  @note SD and LCD share the SPI bus, so the bus is arbitrated by lockBus/unlockBus
+ */
+#include "gob_gmv_prefetcher.hpp"
+#include "gob_gmv_file.hpp"
+#include "scoped_profiler.hpp"
+
+namespace gob
+{
+
+bool GMVPrefetcher::begin(GMVFile* gmv, uint8_t* const* buffers, const uint32_t count, const uint32_t size,
+                          const BaseType_t core, const UBaseType_t priority)
+{
+    if(_task || !gmv || !buffers || count == 0 || count > MaxSlots) { return false; }
+
+    _gmv = gmv;
+    _count = count;
+    _size = size;
+    for(uint32_t i = 0; i < count; ++i) { _slots[i] = {}; _slots[i].buf = buffers[i]; }
+    _widx = _ridx = _filled = _held = 0;
+    _active = _eof = _quit = false;
+
+    _busLock = xSemaphoreCreateMutex();
+    _ready = xSemaphoreCreateBinary();
+    if(!_busLock || !_ready) { end(); return false; }
+
+    if(xTaskCreatePinnedToCore(task_loader, "task_loader", 4096, this, priority, &_task, core) != pdPASS)
+    {
+        _task = nullptr;
+        end();
+        return false;
+    }
+    return true;
+}
+
+void GMVPrefetcher::end()
+{
+    if(_task)
+    {
+        stop();
+        _quit = true;
+        xTaskNotifyGive(_task);
+        while(_task) { vTaskDelay(1); }
+    }
+    if(_ready) { vSemaphoreDelete(_ready); _ready = nullptr; }
+    if(_busLock) { vSemaphoreDelete(_busLock); _busLock = nullptr; }
+    _gmv = nullptr;
+}
+
+void GMVPrefetcher::start()
+{
+    if(!_task) { return; }
+    lockBus();
+    _widx = _ridx = _filled = _held = 0;
+    _eof = false;
+    _active = true;
+    xSemaphoreTake(_ready, 0); // Discard the stale signal
+    unlockBus(); // Wake up the loader
+}
+
+void GMVPrefetcher::stop()
+{
+    if(!_task) { return; }
+    // The loader reads the file only while holding the bus
+    lockBus();
+    _active = false;
+    unlockBus();
+}
+
+bool GMVPrefetcher::pop(Block& blk, const TickType_t wait)
+{
+    for(;;)
+    {
+        bool done{};
+        portENTER_CRITICAL(&_mux);
+        if(_filled)
+        {
+            blk = _slots[_ridx];
+            _ridx = (_ridx + 1) % _count;
+            --_filled;
+            ++_held;
+            portEXIT_CRITICAL(&_mux);
+            return true;
+        }
+        done = !_active || _eof;
+        portEXIT_CRITICAL(&_mux);
+
+        if(done || !xSemaphoreTake(_ready, wait)) { return false; }
+    }
+}
+
+void GMVPrefetcher::release()
+{
+    portENTER_CRITICAL(&_mux);
+    if(_held) { --_held; }
+    portEXIT_CRITICAL(&_mux);
+    if(_task) { xTaskNotifyGive(_task); }
+}
+
+uint32_t GMVPrefetcher::takeReadCycle()
+{
+    portENTER_CRITICAL(&_mux);
+    uint32_t c = _readCycle;
+    _readCycle = 0;
+    portEXIT_CRITICAL(&_mux);
+    return c;
+}
+
+// Load one block to the free slot
+// Return true if it can continue to load.
+bool GMVPrefetcher::load()
+{
+    if(_waiting) { return false; } // Notified by unlockBus()
+    xSemaphoreTake(_busLock, portMAX_DELAY);
+
+    portENTER_CRITICAL(&_mux);
+    bool can = _active && !_eof && (_filled + _held < _count);
+    portEXIT_CRITICAL(&_mux);
+    if(!can) { xSemaphoreGive(_busLock); return false; }
+
+    auto& s = _slots[_widx];
+    uint32_t cycle{};
+    {
+        ScopedProfile(cycle);
+        TraceScope("sd_read");
+        std::tie(s.imageSize, s.wavSize) = _gmv->readBlock(s.buf, _size);
+    }
+    s.frame = _gmv->readCount();
+    bool loaded = s.imageSize || s.wavSize;
+
+    portENTER_CRITICAL(&_mux);
+    _readCycle += cycle;
+    if(loaded)
+    {
+        _widx = (_widx + 1) % _count;
+        ++_filled;
+    }
+    _eof = !loaded || _gmv->eof();
+    portEXIT_CRITICAL(&_mux);
+
+    xSemaphoreGive(_busLock);
+    xSemaphoreGive(_ready);
+    return loaded;
+}
+
+void GMVPrefetcher::task_loader(void* arg)
+{
+    GMVPrefetcher* self = (GMVPrefetcher*)arg;
+    for(;;)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if(self->_quit) { break; }
+        while(self->load()) { ; }
+    }
+    self->_task = nullptr;
+    vTaskDelete(nullptr);
+}
+//
+}
@@ -0,0 +1,94 @@
+/*!
+  @file gob_gmv_prefetcher.hpp
+  @brief Read-ahead GMV blocks by the task on the other core
+  @note SD and LCD share the SPI bus, so the bus is arbitrated by lockBus/unlockBus
+ */
+#ifndef GOB_GMV_PREFETCHER_HPP
+#define GOB_GMV_PREFETCHER_HPP
+
+#include <cstdint>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+namespace gob
+{
+class GMVFile;
+
+class GMVPrefetcher
+{
+  public:
+    static constexpr uint32_t MaxSlots = 16;
+
+    //! @brief Loaded block
+    struct Block
+    {
+        uint8_t* buf{};       //!< @brief image + wav
+        uint32_t imageSize{}; //!< @brief Size of image
+        uint32_t wavSize{};   //!< @brief Size of wav
+        uint32_t frame{};     //!< @brief Block number
+    };
+
+    GMVPrefetcher() {}
+    ~GMVPrefetcher() { end(); }
+
+    /*!
+      @brief Create loader task
+      @param gmv Source file (Do not access it from other task while started)
+      @param buffers Slots of the ring (count must be less than or equal to MaxSlots)
+      @param count Number of the buffers
+      @param size Size of each buffer
+      @param core Core of the loader task
+      @param priority Priority of the loader task
+     */
+    bool begin(GMVFile* gmv, uint8_t* const* buffers, const uint32_t count, const uint32_t size,
+               const BaseType_t core = 0, const UBaseType_t priority = 1);
+    void end();
+
+    //! @brief Start read-ahead from the current position of the file
+    void start();
+    //! @brief Stop read-ahead (Loader does not access the file after return)
+    void stop();
+
+    /*!
+      @brief Get the oldest loaded block
+      @retval ==true Success (Block is held until release())
+      @retval ==false Timeout or end of file
+     */
+    bool pop(Block& blk, const TickType_t wait = portMAX_DELAY);
+    //! @brief Return the oldest held block to the loader
+    void release();
+
+    //! @brief Number of blocks loaded but not popped
+    uint32_t filled() const { return _filled; }
+    //! @brief Number of blocks popped but not released
+    uint32_t held() const { return _held; }
+    //! @brief Time spent reading the file (us) since the last call (ENABLE_PROFILE only)
+    uint32_t takeReadCycle();
+
+    // SPI bus shared with LCD. Take it before display.startWrite() and give it after display.endWrite()
+    // The loader gives way to the waiting caller. (Call from only one task)
+    void lockBus() { ++_waiting; xSemaphoreTake(_busLock, portMAX_DELAY); --_waiting; }
+    void unlockBus() { xSemaphoreGive(_busLock); if(_task) { xTaskNotifyGive(_task); } }
+
+  protected:
+    static void task_loader(void* arg);
+    bool load();
+
+  private:
+    GMVFile* _gmv{};
+    Block _slots[MaxSlots]{};
+    uint32_t _count{}, _size{};
+    volatile uint32_t _widx{}, _ridx{}, _filled{}, _held{};
+    volatile uint32_t _waiting{};
+    uint32_t _readCycle{};
+    volatile bool _active{}, _eof{}, _quit{};
+
+    portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+    SemaphoreHandle_t _busLock{};
+    SemaphoreHandle_t _ready{};
+    TaskHandle_t _task{};
+};
+//
+}
+#endif
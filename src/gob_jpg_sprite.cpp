@@ -21,31 +21,17 @@ static void write888(uint8_t* dst, const uint8_t* src, uint32_t line, uint32_t o
     } while (--h);
 }
     
+// src is swap565
 static void write565(uint8_t* dst, const uint8_t* src, uint32_t line, uint32_t outWidth, uint32_t w, uint32_t h)
 {
-    do
-    {
-        auto s = src;
-        auto d = dst;
-        uint32_t l = line;
-        while (l--)
-        {
-            uint32_t r = s[0];
-            uint32_t g = s[1];
-            uint32_t b = s[2];
-            s += 3;
-            g = g >> 2;
-            r = (r >> 3) & 0x1F;
-            r = (r << 3) + (g >> 3);
-            b = (b >> 3) + (g << 5);
-            d[0] = r;
-            d[1] = b;
-            d += 2;
-        }
-        dst += outWidth * 2;
-        src += w * 3;
-    }
-    while (--h);
+    line *= 2;
+    outWidth *= 2;
+    w *= 2;
+    do {
+        memcpy(dst, src, line);
+        src += w;
+        dst += outWidth;
+    } while (--h);
 }
 
 static void write332(uint8_t* dst, const uint8_t* src, uint32_t line, uint32_t outWidth, uint32_t w, uint32_t h)
@@ -87,11 +73,13 @@ void JpgSprite::setup()
 {
     _fp_write = nullptr;
     _bytesize = 0;
+    _jdec.format = TJpgD::JDF_RGB888;
     switch (getColorDepth())
     {
     case lgfx::color_depth_t::rgb565_2Byte:
       _fp_write = write565;
       _bytesize = 2;
+      _jdec.format = TJpgD::JDF_SWAP565; // Decoder outputs swap565 directly
       break;
     case lgfx::color_depth_t::rgb888_3Byte:
       _fp_write = write888;
@@ -119,22 +107,33 @@ bool JpgSprite::drawJpgEx(const uint8_t* buf, const int32_t len, const int32_t o
         //Serial.printf("fp_write NULL\n");
         return false;
     }
-    _filebuf = buf;
-    _fileindex = 0;
-    _remain = len;
-
-    TJpgD::JRESULT jres = _jdec.prepare(jpgRead, this);
+    TJpgD::JRESULT jres = _jdec.prepare(buf, len, this); // Decode directly from buf
     if (jres != TJpgD::JDR_OK)
     {
         Serial.printf("prepare failed! %d\r\n", jres);
         return false;
     }
 
-    _out_width = std::min<int32_t>(_jdec.width, width());
-    _out_height = std::min<int32_t>(_jdec.height, height());
+    // Decode at reduced size while the result still covers the width or height of the sprite (Same as MainClass)
+    uint8_t scale = _scale;
+    if (_autoScale)
+    {
+        scale = 0;
+        while (scale < 3 &&
+               ((_jdec.width >> (scale + 1)) >= width() || (_jdec.height >> (scale + 1)) >= height()))
+        {
+            ++scale;
+        }
+    }
+    _jdec.scale = scale;
+
+    const int32_t jw = _jdec.scaled_width();
+    const int32_t jh = _jdec.scaled_height();
+    _out_width = std::min<int32_t>(jw, width());
+    _out_height = std::min<int32_t>(jh, height());
 
-    if(ox >= _jdec.width || oy >= _jdec.height
-       || ox + _jdec.width < 0 || oy + _jdec.height < 0)
+    if(ox >= jw || oy >= jh
+       || ox + jw < 0 || oy + jh < 0)
     {
         Serial.printf("Out of range d(%d,%d)\r\n", ox, oy);
         return false;
@@ -142,6 +141,7 @@ bool JpgSprite::drawJpgEx(const uint8_t* buf, const int32_t len, const int32_t o
     }
     _off_x = ox;
     _off_y = oy;
+    _jdec.set_viewport(-ox, -oy, width(), height()); // MCUs out of the sprite are not decoded
 
     jres = _jdec.decomp_multitask(jpgWrite, jpgWriteRow);
     if (jres != TJpgD::JDR_OK)
@@ -152,19 +152,6 @@ bool JpgSprite::drawJpgEx(const uint8_t* buf, const int32_t len, const int32_t o
     return true;
 }
 
-uint32_t JpgSprite::jpgRead(TJpgD *jdec, uint8_t *buf, uint32_t len)
-{
-    JpgSprite* me = (JpgSprite*)jdec->device;
-    if (len > me->_remain)  len = me->_remain;
-    if (buf)
-    {
-        memcpy(buf, (const uint8_t *)me->_filebuf + me->_fileindex, len);
-    }
-    me->_fileindex += len;
-    me->_remain -= len;
-    return len;
-}
-
 uint32_t JpgSprite::jpgWrite(TJpgD *jdec, void *bitmap, TJpgD::JRECT *rect)
 {
     JpgSprite* me = (JpgSprite*)jdec->device;
@@ -185,6 +172,7 @@ uint32_t JpgSprite::jpgWrite(TJpgD *jdec, void *bitmap, TJpgD::JRECT *rect)
         
     uint8_t *src = (uint8_t*)bitmap;
     uint_fast16_t oL = 0, oR = 0;
+    const int32_t sbytes = (jdec->format == TJpgD::JDF_SWAP565) ? 2 : 3; // Bytes per pixel of bitmap
 
     uint8_t* dst = (uint8_t*)me->_panel_sprite.getBuffer();
     dst += dy * (sWidth * me->_bytesize) + dx * me->_bytesize;
@@ -192,7 +180,7 @@ uint32_t JpgSprite::jpgWrite(TJpgD *jdec, void *bitmap, TJpgD::JRECT *rect)
     if (-me->_off_y > y)
     {
         auto skip = -me->_off_y - y;
-        src += skip * w * 3;
+        src += skip * w * sbytes;
         dst += skip * (sWidth * me->_bytesize);
         h -= skip;
     }
@@ -211,7 +199,7 @@ uint32_t JpgSprite::jpgWrite(TJpgD *jdec, void *bitmap, TJpgD::JRECT *rect)
     int32_t line = (w - ( oL + oR ));
 
     dst += oL * me->_bytesize;
-    src += oL * 3;
+    src += oL * sbytes;
     me->_fp_write(dst, src, line, sWidth, w, h);
     return 1;
 }
@@ -37,22 +37,33 @@ class JpgSprite : public LGFX_Sprite
     bool drawJpgEx(const uint8_t* buf, const int32_t len,
                    const int32_t ox = 0, const int32_t oy = 0);
 
+    /*!
+      @brief Decode at 1/2, 1/4, 1/8 if the image is larger than the sprite (default true)
+      @note The scale is the largest one that still covers the width or height of the sprite (Same as MainClass)
+     */
+    void setAutoScale(const bool enable) { _autoScale = enable; }
+    /*!
+      @brief Set the decoding scale (Overrides the automatic scale)
+      @param scale 0:1/1, 1:1/2, 2:1/4, 3:1/8
+      @note Offsets of drawJpgEx are in scaled coordinates
+     */
+    void setScale(const uint8_t scale) { _scale = std::min<uint8_t>(scale, 3); _autoScale = false; }
+    //! @brief Gets the scale of the last drawJpgEx
+    uint8_t getScale() const { return _jdec.scale; }
+
   protected:
-    static uint32_t jpgRead(TJpgD *jdec, uint8_t *buf, uint32_t len);
     static uint32_t jpgWrite(TJpgD *jdec, void *bitmap, TJpgD::JRECT *rect);
     static uint32_t jpgWriteRow(TJpgD *jdec, uint32_t y, uint32_t h) { return 1; }
     
   protected:
     TJpgD _jdec{};
 
-    int32_t _remain{};
-    const uint8_t* _filebuf{};
-    uint32_t _fileindex{};
-
     uint_fast8_t _bytesize{};
     int32_t _out_width{};
     int32_t _out_height{};
     int32_t _off_x{}, _off_y{};
+    uint8_t _scale{}; // Scale if not automatic
+    bool _autoScale{true};
 
     using FpWrite = void(*)(uint8_t* dst, const uint8_t* src, uint32_t line, uint32_t outWidth, uint32_t w, uint32_t h);
     FpWrite _fp_write{};
@@ -0,0 +1,115 @@
+/*!
+  @file gob_telemetry.cpp
+  @brief Playback statistics in fixed memory
+ */
+#include "gob_telemetry.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <iterator>
+
+namespace gob
+{
+
+void LogHistogram::clear()
+{
+    _count = _min = _max = 0;
+    _sum = 0;
+    std::fill(std::begin(_hist), std::end(_hist), 0);
+}
+
+void LogHistogram::push(uint32_t v)
+{
+    _min = _count ? std::min(_min, v) : v;
+    _max = std::max(_max, v);
+    _sum += v;
+    ++_count;
+    ++_hist[index(v)];
+}
+
+uint32_t LogHistogram::percentile(const uint32_t pct) const
+{
+    uint64_t target = ((uint64_t)_count * pct + 99) / 100, acc{};
+    for(uint32_t i = 0; i < Buckets; ++i)
+    {
+        acc += _hist[i];
+        if(acc && acc >= target) { return std::min(upper(i), _max); }
+    }
+    return _max;
+}
+
+// [0, SubBuckets) are exact. The others are (octave << SubBits) | (SubBits bits after the MSB)
+uint32_t LogHistogram::index(const uint32_t v)
+{
+    if(v < SubBuckets) { return v; }
+    uint32_t msb = 31 - __builtin_clz(v);
+    if(msb >= MaxBits) { return Buckets - 1; }
+    uint32_t shift = msb - SubBits;
+    return ((shift + 1) << SubBits) | ((v >> shift) & (SubBuckets - 1));
+}
+
+uint32_t LogHistogram::upper(const uint32_t idx)
+{
+    uint32_t octave = idx >> SubBits;
+    if(!octave) { return idx; }
+    uint32_t shift = octave - 1;
+    return (((SubBuckets | (idx & (SubBuckets - 1))) << shift) + (1U << shift) - 1);
+}
+
+void Telemetry::begin()
+{
+    for(auto& h : _hist) { h.clear(); }
+    _frames = _dropped = _late = _underrun = 0;
+    _bytes = 0;
+    _interval = 0.0f;
+    _start = _last = ESP32Clock::now();
+}
+
+void Telemetry::frame(const ESP32Clock::time_point& now)
+{
+    if(_frames)
+    {
+        uint32_t us = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(now - _last).count();
+        record(Interval, us);
+        _interval = (_interval > 0.0f) ? _interval + (us - _interval) / 8.0f : us;
+    }
+    _last = now;
+    ++_frames;
+}
+
+int64_t Telemetry::elapsed() const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(_last - _start).count();
+}
+
+float Telemetry::averageFps() const
+{
+    auto& h = _hist[Interval];
+    return h.average() ? 1000000.0f / h.average() : 0.0f;
+}
+
+uint32_t Telemetry::bytesPerSecond() const
+{
+    auto us = elapsed();
+    return us > 0 ? (uint32_t)(_bytes * 1000000ULL / us) : 0;
+}
+
+void Telemetry::dump(void(*out)(const char*), const char* name) const
+{
+    static const char* const names[Stages] = { "load", "decode", "dma", "audio", "read", "interval" };
+    char line[128];
+
+    snprintf(line, sizeof(line), "[%s] frames:%u drop:%u late:%u underrun:%u fps:%2.2f sd:%uB/s",
+             name ? name : "", _frames, _dropped, _late, _underrun, averageFps(), bytesPerSecond());
+    out(line);
+
+    for(uint_fast8_t s = 0; s < Stages; ++s)
+    {
+        auto& h = _hist[s];
+        if(!h.count()) { continue; }
+        snprintf(line, sizeof(line), " %-8s n:%u min:%u avg:%u p50:%u p99:%u max:%u us",
+                 names[s], h.count(), h.min(), h.average(), h.percentile(50), h.percentile(99), h.max());
+        out(line);
+    }
+}
+//
+}
@@ -0,0 +1,110 @@
+/*!
+  @file gob_telemetry.hpp
+  @brief Playback statistics in fixed memory
+  @note Stage times are measured only if ENABLE_PROFILE or ENABLE_TELEMETRY (See also scoped_profiler.hpp)
+ */
+#ifndef GOB_TELEMETRY_HPP
+#define GOB_TELEMETRY_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include "esp32_clock.hpp"
+
+namespace gob
+{
+
+/*!
+  @class LogHistogram
+  @brief Histogram of the log-linear buckets
+  @note Each power of two is divided into SubBuckets. Values less than SubBuckets are exact.
+  Relative error of percentile is less than 1/SubBuckets.
+ */
+class LogHistogram
+{
+  public:
+    static constexpr uint32_t SubBits = 3;
+    static constexpr uint32_t SubBuckets = 1U << SubBits;
+    static constexpr uint32_t MaxBits = 24; //!< @brief Larger values are clamped
+    static constexpr uint32_t Buckets = (MaxBits - SubBits + 1) * SubBuckets;
+
+    void clear();
+    void push(uint32_t v);
+
+    uint32_t count() const { return _count; }
+    uint32_t min() const { return _min; }
+    uint32_t max() const { return _max; }
+    uint32_t average() const { return _count ? (uint32_t)(_sum / _count) : 0; }
+    //! @brief Upper bound of the bucket that includes pct %
+    uint32_t percentile(const uint32_t pct) const;
+
+  protected:
+    static uint32_t index(const uint32_t v);
+    static uint32_t upper(const uint32_t idx);
+
+  private:
+    uint32_t _count{}, _min{}, _max{};
+    uint64_t _sum{};
+    uint32_t _hist[Buckets]{};
+};
+
+/*!
+  @class Telemetry
+  @brief Per-stage latency and the counters of the clip
+ */
+class Telemetry
+{
+  public:
+    enum Stage : uint8_t
+    {
+        Load,      //!< @brief Wait for the block from the prefetcher
+        Decode,    //!< @brief drawJpg
+        DMA,       //!< @brief Wait for the DMA on release the bus
+        Audio,     //!< @brief Wait for the speaker queue
+        Read,      //!< @brief Reading the SD by the prefetcher
+        Interval,  //!< @brief Between the frames
+        Stages
+    };
+
+    //! @brief Start the clip
+    void begin();
+
+    void record(const Stage s, const uint32_t us) { _hist[s].push(us); }
+    //! @brief Frame is presented
+    void frame(const ESP32Clock::time_point& now);
+    void dropped() { ++_dropped; }
+    void late() { ++_late; }
+    void underrun() { ++_underrun; }
+    void readBytes(const uint32_t bytes) { _bytes += bytes; }
+
+    uint32_t frames() const { return _frames; }
+    uint32_t droppedFrames() const { return _dropped; }
+    uint32_t lateFrames() const { return _late; }
+    uint32_t underruns() const { return _underrun; }
+    const LogHistogram& histogram(const Stage s) const { return _hist[s]; }
+    //! @brief Smoothed fps
+    float fps() const { return _interval > 0.0f ? 1000000.0f / _interval : 0.0f; }
+    //! @brief Average fps of the clip
+    float averageFps() const;
+    //! @brief Read bytes per second of the clip
+    uint32_t bytesPerSecond() const;
+
+    /*!
+      @brief Output the summary of the clip
+      @param out Output function for each line
+      @param name Name of the clip
+     */
+    void dump(void(*out)(const char*), const char* name) const;
+
+  protected:
+    int64_t elapsed() const;
+
+  private:
+    LogHistogram _hist[Stages]{};
+    uint32_t _frames{}, _dropped{}, _late{}, _underrun{};
+    uint64_t _bytes{};
+    float _interval{}; // Smoothed interval (us)
+    ESP32Clock::time_point _start{}, _last{};
+};
+//
+}
+#endif
@@ -22,18 +22,25 @@
 # include <M5StackUpdater.h>
 #endif
 
+#if defined(FBSD_ENABLE_BENCHMARK)
+# pragma message "[FBSD] Enable benchmark"
+# if !defined(ENABLE_PROFILE)
+#  error "FBSD_ENABLE_BENCHMARK requires ENABLE_PROFILE"
+# endif
+#endif
+
 #include <esp_system.h>
 #include <esp_idf_version.h>
 
 #include "scoped_profiler.hpp"
 #include "MainClass.h"
 #include "gob_gmv_file.hpp"
+#include "gob_gmv_prefetcher.hpp"
+#include "gob_av_clock.hpp"
+#include "gob_telemetry.hpp"
 #include "file_list.hpp"
 #include <gob_unifiedButton.hpp>
 
-#include <deque>
-#include <numeric>
-
 #ifndef TFCARD_CS_PIN
 # define TFCARD_CS_PIN (4)
 #endif
@@ -50,8 +57,19 @@
 #define BUFFER_SIZE (JPG_BUFFER_SIZE + WAV_BLOCK_BUFFER_SIZE)
 
 #ifndef NUMBER_OF_BUFFERS
-#define NUMBER_OF_BUFFERS (3)  // Circular buffer
+#define NUMBER_OF_BUFFERS (5)  // Circular buffer (AUDIO_QUEUE_DEPTH + read-ahead blocks)
+#endif
+
+// Number of the blocks that the speaker refers to. (playing + queued)
+#define AUDIO_QUEUE_DEPTH (2)
+static_assert(NUMBER_OF_BUFFERS > AUDIO_QUEUE_DEPTH, "NUMBER_OF_BUFFERS must be greater than AUDIO_QUEUE_DEPTH");
+
+// The bus is kept over the frames while the read-ahead blocks are at least this number.
+// Otherwise it is given to the prefetcher after the DMA is completed.
+#ifndef READ_AHEAD_LOW
+# define READ_AHEAD_LOW ((NUMBER_OF_BUFFERS - AUDIO_QUEUE_DEPTH > 2) ? (NUMBER_OF_BUFFERS - AUDIO_QUEUE_DEPTH - 1) : 1)
 #endif
+static_assert(READ_AHEAD_LOW > 0, "READ_AHEAD_LOW must be greater than 0");
 
 // For debug
 //#define FIXED_FRAME (100)
@@ -62,54 +80,49 @@ namespace
 using UpdateDuration = std::chrono::duration<float, std::ratio<1, BASE_FPS> >;
 //UpdateDuration durationTime{1}; // 1 == (1 / BASE_FPS)
 ESP32Clock::time_point lastTime{};
-float fps{};
-std::deque<float> fpsQueue{BASE_FPS/*reserve size*/};
-
-float averageFps()
-{
-    if(fpsQueue.empty()) { return 0.0f; }
-    return std::accumulate(fpsQueue.cbegin(), fpsQueue.cend(), 0.0f) / fpsQueue.size();
-}
-void clearFpsQueue() { fpsQueue.clear(); }
-void pushFpsQueue(const float f)
-{
-    if(fpsQueue.size() >= BASE_FPS) { fpsQueue.pop_front(); }
-    fpsQueue.emplace_back(f);
-
-}
-#if 0
 // std::this_thread::sleep_until returns earlier than the specified time, so implemeted own function.
-void sleepUntil(const std::chrono::time_point<ESP32Clock, UpdateDuration>& absTime)
+void sleepUntil(const ESP32Clock::time_point& absTime)
 {
     auto us = std::chrono::duration_cast<std::chrono::microseconds>(absTime - ESP32Clock::now()).count();
-    //delay(us >= 0 ? us/1000 : 0); // ms
-    if(us > 1000)
+    // Sleep whole ticks except the last one, and spin for the rest
+    if(us > 1000 * portTICK_PERIOD_MS * 2)
     {
-        auto tc = xTaskGetTickCount();
-        vTaskDelayUntil(&tc, us/1000/portTICK_PERIOD_MS);
+        vTaskDelay(us / 1000 / portTICK_PERIOD_MS - 1);
     }
-    //auto at = std::chrono::time_point_cast<ESP32Clock::duration>(absTime);
-    //while(ESP32Clock::now() < at) { taskYIELD(); }
-    while(std::chrono::time_point_cast<UpdateDuration>(ESP32Clock::now()) < absTime) { taskYIELD(); }
+    while(ESP32Clock::now() < absTime) { taskYIELD(); }
 }
-#endif
 
 auto& display = M5.Display;
 SdFs sd;
 
 uint8_t volume{}; // 0~255
 uint32_t currentFrame{}, maxFrames{};
-uint32_t loadCycle{}, drawCycle{}, wavCycle{};
-uint32_t loadCycleTotal{}, drawCycleTotal{}, wavCycleTotal{};
+uint32_t loadCycle{}, drawCycle{}, wavCycle{}, dmaCycle{}, readCycle{};
 bool primaryDisplay{};
+bool busOccupied{}; // Bus and the transaction of the display are kept by loopRender
+
+// Per-stage occupancy in the period (us)
+struct Occupancy
+{
+    uint32_t frames{}, elapsed{}, read{}, decode{}, dma{}, wav{}, held{};
+    void clear() { *this = Occupancy{}; }
+} occupancy;
 
 MainClass mainClass;
 
 FileList list;
 gob::GMVFile gmv{};
+gob::GMVPrefetcher prefetcher{};
 
 uint8_t* buffers[NUMBER_OF_BUFFERS]; // For 1 of JPEG and wav block
-uint32_t bufferIndex{}, outIndex{}, jpegSize{}, wavSize{}, wavTotal{};
+const uint8_t* outBuffer{};
+uint32_t jpegSize{}, wavSize{}, wavTotal{};
+
+// Audio master clock. Frames are dropped if late, and waited for if early.
+gob::AVClock avClock;
+uint32_t playFrame{}; // Number of the frames presented or dropped in the clip
+
+gob::Telemetry telemetry;
 
 goblib::UnifiedButton unifiedButton;
 
@@ -136,70 +149,67 @@ PROGMEM const char* ptTable[] = { ptSingle, ptRepeatSingle, ptRepeatAll, ptRepea
 //
 }
 
-// Load one of the JPEG image and wav block
-// WARNING: BUS must be released
+// Get one of the JPEG image and wav block
+// The block is loaded by the prefetcher, or directly if FIXED_FRAME
 static bool load1Frame()
 {
     if(!gmv) { return false; }
 
-    auto buf = buffers[bufferIndex];
-#if !defined(FIXED_FRAME) && !defined(START_FRAME)
-    if(!gmv.eof())
+#if !defined(FIXED_FRAME)
+    gob::GMVPrefetcher::Block blk{};
     {
-        {
-            ScopedProfile(loadCycle);
-            std::tie(jpegSize, wavSize) = gmv.readBlock(buf, BUFFER_SIZE);
-            outIndex = bufferIndex;
-            ++bufferIndex;
-            bufferIndex %= 3;
-            currentFrame = gmv.readCount();
-        }
-        return jpegSize || wavSize;
+        ScopedProfile(loadCycle);
+        TraceScope("load");
+        if(!prefetcher.pop(blk)) { jpegSize = wavSize = 0; return false; }
     }
-    return false;
-#elif defined(FIXED_FRAME)
+    outBuffer = blk.buf;
+    jpegSize = blk.imageSize;
+    wavSize = blk.wavSize;
+    currentFrame = blk.frame;
+    return jpegSize || wavSize;
+#else
+    // WARNING: BUS must be released
     auto frame = (FIXED_FRAME < gmv.blocks()) ? FIXED_FRAME : gmv.blocks() - 1;
-    while(!gmv.eof() && currentFrame < frame)
-    {
-        std::tie(jpegSize, wavSize) = gmv.readBlock(buf, BUFFER_SIZE);
-        currentFrame = gmv.readCount();
-    }
+    if(!gmv.seek(frame)) { return false; }
+    std::tie(jpegSize, wavSize) = gmv.readBlock(buffers[0], BUFFER_SIZE);
+    outBuffer = buffers[0];
+    currentFrame = gmv.readCount();
     return true;
-#elif defined(START_FRAME)
-    auto frame = (START_FRAME < gmv.blocks()) ? START_FRAME : gmv.blocks() - 1;
-    if(currentFrame < frame)
-    {
-        M5_LOGI("Goto %u", frame);
-        while(!gmv.eof() && currentFrame < frame)
-        {
-            std::tie(jpegSize, wavSize) = gmv.readBlock(buf, BUFFER_SIZE);
-            currentFrame = gmv.readCount();
-        }
-        return true;
-    }
-    if(!gmv.eof())
-    {
-        {
-            ScopedProfile(loadCycle);
-            std::tie(jpegSize, wavSize) = gmv.readBlock(buf, BUFFER_SIZE);
-            outIndex = bufferIndex;
-            ++bufferIndex;
-            bufferIndex %= 3;
-            currentFrame = gmv.readCount();
-        }
-        return jpegSize || wavSize;
-    }
-    return false;
 #endif
 }
 
+// Occupy the bus and begin the transaction of the display if not yet
+static void occupyBus()
+{
+    if(busOccupied) { return; }
+    prefetcher.lockBus();
+    display.startWrite();
+    busOccupied = true;
+}
+
+// Wait for the DMA and give the bus to the prefetcher
+static void releaseBus()
+{
+    if(!busOccupied) { return; }
+    mainClass.wait();
+    display.endWrite();
+    prefetcher.unlockBus();
+    busOccupied = false;
+}
+
 // WARNING: BUS must be released
-static bool playMovie(const String& path, const bool bus = true)
+static bool playMovie(const String& path)
 {
     M5.Speaker.stop();
+    prefetcher.stop();
     wavTotal = currentFrame = maxFrames = 0;
-    loadCycleTotal = wavCycleTotal = drawCycleTotal = 0;
-    clearFpsQueue();
+    playFrame = 0;
+    telemetry.begin();
+#if defined(ENABLE_TRACE)
+    gob::Trace::clear();
+    gob::Trace::enable(true);
+#endif
+    occupancy.clear();
     
     if(gmv) { gmv.close(); }
     if(!gmv.open(path) || gmv.fps() == 0)
@@ -209,15 +219,23 @@ static bool playMovie(const String& path, const bool bus = true)
 
     maxFrames = gmv.blocks();
     M5_LOGI("[%s] MaxFrames:%u FrameRate:%f", path.c_str(), maxFrames, gmv.fps());
-    
-    // durationTime is calculated from frame rate.
-    //durationTime = UpdateDuration((float)BASE_FPS / gmv.fps());
 
     const auto& wh = gmv.wavHeader();
     M5_LOGI("Wav rate:%u bit_per_sample:%u ch:%u blocksize:%u byte_per_sec:%u",
             wh.sample_rate, wh.bit_per_sample, wh.channel, wh.block_size, wh.byte_per_sec);
+    avClock.reset(wh.byte_per_sec, gmv.fps());
 
-    if(bus) { display.startWrite(); }
+#if defined(START_FRAME)
+    auto frame = (START_FRAME < gmv.blocks()) ? START_FRAME : gmv.blocks() - 1;
+    M5_LOGI("Goto %u %s", frame, gmv.hasIndex() ? "(index)" : "");
+    if(!gmv.seek(frame))
+    {
+        M5_LOGE("Failed to seek %u", frame); return false;
+    }
+#endif
+#if !defined(FIXED_FRAME)
+    prefetcher.start();
+#endif
     return true;
 }
 
@@ -323,7 +341,18 @@ void setup()
         M5_LOGI("Buffer:%p", buf);
     }
     
-    mainClass.setup(&display);
+    if(!mainClass.setup(&display))
+    {
+        M5_LOGE("Failed to setup mainClass");
+        display.clear(TFT_RED); while(1) { delay(10000); }
+    }
+
+    // Read-ahead task on core 0 (Same core as the output task of the decoder, it works while decoding is not in progress)
+    if(!prefetcher.begin(&gmv, buffers, NUMBER_OF_BUFFERS, BUFFER_SIZE, 0 /* core */))
+    {
+        M5_LOGE("Failed to begin prefetcher");
+        display.clear(TFT_RED); while(1) { delay(10000); }
+    }
     
     // Information
     M5_LOGI("ESP-IDF Version %d.%d.%d",
@@ -395,9 +424,24 @@ static void loopMenu()
     unifiedButton.draw(dirty);
 }
 
+// Summary of the clip (Once per clip)
+static void reportClip()
+{
+    if(!playFrame) { return; }
+    telemetry.dump([](const char* line) { M5_LOGI("%s", line); }, list.getCurrent().c_str());
+#if defined(ENABLE_TRACE)
+    // The last events of the clip (Convert to JSON by script/trace.py)
+    gob::Trace::dump([](const char* line) { M5_LOGI("%s", line); });
+#endif
+    playFrame = 0;
+}
+
 static void changeToMenu()
 {
+    releaseBus();
+    reportClip();
     M5.Speaker.stop();
+    prefetcher.stop();
     loop_f = loopMenu;
     unifiedButton.changeAppearance(goblib::UnifiedButton::appearance_t::bottom);
     display.clear(0);
@@ -405,64 +449,53 @@ static void changeToMenu()
 }
 
 // Render to lcd directly with DMA
+// Pipeline of the frames
+//  SD  : The prefetcher reads N+2 and later while the bus is released
+//  CPU : Decode N+1 (drawJpg returns after the decoding)
+//  DMA : The bands of N are pushed, the first band of N+1 follows the last band of N
+// The bus is kept over the frames while the read-ahead is enough, so decoding is not stalled by the DMA tail.
 static void loopRender()
 {
-    static float afps{};
-
-#if defined(DEBUG)
-    display.setCursor(0, 4);
-    display.printf("F:%2.2f C:%u", afps, currentFrame);
-#endif
-    
-    // 0:Wait dma done (Completed rendering to lcd?)
-    while(mainClass.isBusy()) { delay(1); }
-    
-    // 1:Release BUS
-    display.endWrite();
-
     // Change volume
     if(M5.BtnA.isPressed()) { if(volume >   0) { M5.Speaker.setVolume(--volume); }}
     if(M5.BtnC.isPressed()) { if(volume < 255) { M5.Speaker.setVolume(++volume); }}
     // Stop
     if(M5.BtnB.wasClicked()) { changeToMenu(); return; }
 
-    // 2:Load one block of the image and wav from SDg
+    // 1:Get one block of the image and wav (Loaded from SD by the prefetcher)
     if(currentFrame >= maxFrames - 1) // End of file
     {
+        reportClip();
         switch(playType)
         {
         case PlayType::RepeatAll:
         case PlayType::Shuffle:
-            M5_LOGD("Total: %u / %u / %u", loadCycleTotal, wavCycleTotal, drawCycleTotal);
             M5_LOGI("To next file");
             list.next();
             // fallthrough
         case PlayType::RepeatSingle:
             M5_LOGI("Playback from top");
+            releaseBus();
+            prefetcher.stop(); // Bus is free from the loader
             display.clear();
-            if(!playMovie(list.getCurrentFullpath(), false)) { changeToMenu(); return; }
+            if(!playMovie(list.getCurrentFullpath())) { changeToMenu(); return; }
             lastTime = ESP32Clock::now();
             break;
         default:
             break; // Nop
         }
     }
-    load1Frame();
-    
-    // 3:Occupy BUS
-    display.startWrite();
-
-    // 4:Start rendering image with DMA
-    {
-        ScopedProfile(drawCycle);
-        mainClass.drawJpg(buffers[outIndex], jpegSize); // Process on multiple cores
-    }
+    if(!load1Frame()) { releaseBus(); return; } // End of file or failed to read
 
-    // 5:Playback audio (Wait for the playback audio queue to empty)
+#if !defined(FBSD_ENABLE_BENCHMARK)
+    // 2:Playback audio (Wait for the playback audio queue to empty, the prefetcher reads SD meanwhile)
+    // The audio is always fed even if the image is dropped, so the clock goes on.
     {
         ScopedProfile(wavCycle);
+        TraceScope("audio");
         auto& wh = gmv.wavHeader();
-        const uint8_t* buf = buffers[outIndex] + jpegSize;
+        const uint8_t* buf = outBuffer + jpegSize;
+        bool underrun = wavTotal && !M5.Speaker.isPlaying(0);
         if(wh.bit_per_sample >> 4)
         {
             M5.Speaker.playRaw((const int16_t*)(buf), wavSize >> 1, wh.sample_rate, wh.channel >= 2, 1, 0);
@@ -471,21 +504,107 @@ static void loopRender()
         {
             M5.Speaker.playRaw(buf, wavSize, wh.sample_rate, wh.channel >= 2, 1, 0);
         }
+        avClock.pushAudio(wavSize, underrun, ESP32Clock::now());
+        if(underrun) { telemetry.underrun(); }
         wavTotal += wavSize;
-        M5_LOGV("outIdx:%u jsz:%u wsz:%u/%u", outIndex, jpegSize, wavSize, wavTotal);
+        M5_LOGV("frame:%u jsz:%u wsz:%u/%u ahead:%u", currentFrame, jpegSize, wavSize, wavTotal, prefetcher.filled());
     }
 
+    // 3:Compare the presentation time of the frame with the playback clock
+    auto pts = avClock.presentation(playFrame++);
+    auto lateness = avClock.position(ESP32Clock::now()) - pts; // us
+    bool drop = jpegSize == 0 || lateness > avClock.frameDuration();
+    if(drop)
+    {
+        // Skip decoding to catch up. The bus is given to the prefetcher meanwhile
+        if(jpegSize) { telemetry.dropped(); }
+        releaseBus();
+    }
+    else if(lateness < 0)
+    {
+        // Early, wait for the presentation time
+        releaseBus();
+        TraceScope("sleep");
+        sleepUntil(ESP32Clock::now() + std::chrono::microseconds(-lateness));
+    }
+    else if(lateness > avClock.frameDuration() / 4) { telemetry.late(); }
+#else
+    // 2,3:Benchmark plays as fast as possible without audio
+    wavCycle = 0;
+    int64_t lateness{};
+    bool drop = jpegSize == 0;
+    ++playFrame;
+#endif
+
+    dmaCycle = drawCycle = 0;
+    if(!drop)
+    {
+        // 4:Occupy BUS (Already occupied if the previous frame kept it)
+        occupancy.held += busOccupied;
+        occupyBus();
+
+#if defined(DEBUG)
+        display.setCursor(0, 4);
+        display.printf("F:%2.2f C:%u D:%u", telemetry.fps(), currentFrame, telemetry.droppedFrames());
+#endif
+
+        // 5:Start rendering image with DMA
+        {
+            ScopedProfile(drawCycle);
+            TraceScope("decode");
+            mainClass.drawJpg(outBuffer, jpegSize); // Process on multiple cores
+        }
+
+        // 6:Release BUS if the read-ahead runs short (The DMA of this frame goes on while kept)
+        if(prefetcher.filled() < READ_AHEAD_LOW)
+        {
+            ScopedProfile(dmaCycle);
+            releaseBus();
+        }
+    }
+
+    // Blocks no longer referenced by the speaker can be reused
+    while(prefetcher.held() > AUDIO_QUEUE_DEPTH) { prefetcher.release(); }
+
     auto now = ESP32Clock::now();
+#if defined(ENABLE_PROFILE)
     auto delta = now - lastTime;
+#endif
     lastTime = now;
-    fps = BASE_FPS / std::chrono::duration_cast<UpdateDuration>(delta).count();
-    pushFpsQueue(fps);
-    afps = averageFps();
+    if(!drop) { telemetry.frame(now); }
+    telemetry.readBytes(jpegSize + wavSize);
+#if defined(ENABLE_PROFILE) || defined(ENABLE_TELEMETRY)
+    readCycle = prefetcher.takeReadCycle();
+    telemetry.record(gob::Telemetry::Load, loadCycle);
+    telemetry.record(gob::Telemetry::Audio, wavCycle);
+    if(readCycle) { telemetry.record(gob::Telemetry::Read, readCycle); }
+    if(!drop)
+    {
+        telemetry.record(gob::Telemetry::Decode, drawCycle);
+        if(dmaCycle) { telemetry.record(gob::Telemetry::DMA, dmaCycle); } // Only if the bus was released
+    }
+#endif
     uint32_t addCycle = loadCycle + wavCycle + drawCycle;
-    loadCycleTotal += loadCycle;
-    wavCycleTotal += wavCycle;
-    drawCycleTotal += drawCycle;
-    M5_LOGD("%5d/%5d %2.2f/%2.2f %u/%u/%u [%u]", currentFrame, maxFrames, fps, afps, loadCycle, wavCycle, drawCycle, addCycle);
+    M5_LOGD("%5d/%5d %2.2f %u/%u/%u [%u] drop:%u late:%u %dus",
+            currentFrame, maxFrames, telemetry.fps(), loadCycle, wavCycle, drawCycle, addCycle,
+            telemetry.droppedFrames(), telemetry.lateFrames(), (int)lateness);
+
+#if defined(ENABLE_PROFILE)
+    // Occupancy of each stage. The total over 100% is the overlap of the stages
+    occupancy.elapsed += (uint32_t)std::chrono::duration_cast<ESP32Clock::duration>(delta).count();
+    occupancy.read += readCycle;
+    occupancy.decode += drawCycle;
+    occupancy.dma += dmaCycle;
+    occupancy.wav += wavCycle;
+    if(++occupancy.frames >= BASE_FPS && occupancy.elapsed)
+    {
+        auto& o = occupancy;
+        M5_LOGI("Occupancy SD:%u%% Decode:%u%% DMA wait:%u%% Audio wait:%u%% Bus kept:%u/%u frames",
+                o.read * 100 / o.elapsed, o.decode * 100 / o.elapsed, o.dma * 100 / o.elapsed, o.wav * 100 / o.elapsed,
+                o.held, o.frames);
+        o.clear();
+    }
+#endif
 }
 
 //
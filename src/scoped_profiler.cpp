@@ -0,0 +1,47 @@
+// Scoped simpled profiler
+#include "scoped_profiler.hpp"
+
+#if defined(ENABLE_TRACE)
+#include <cstdio>
+
+namespace gob
+{
+
+Trace::Ring Trace::_ring[portNUM_PROCESSORS];
+volatile bool Trace::_enable{};
+
+void Trace::clear()
+{
+    bool e = _enable;
+    _enable = false;
+    vTaskDelay(1); // Let the event being written complete
+    for(auto& r : _ring) { r.widx = 0; }
+    _enable = e;
+}
+
+void Trace::dump(void(*out)(const char*))
+{
+    bool e = _enable;
+    _enable = false;
+    vTaskDelay(1);
+
+    char line[96];
+    out("trace begin");
+    for(uint32_t core = 0; core < portNUM_PROCESSORS; ++core)
+    {
+        auto& r = _ring[core];
+        uint32_t w = r.widx;
+        uint32_t num = w < Events ? w : Events;
+        for(uint32_t i = w - num; i != w; ++i)
+        {
+            auto& ev = r.events[i & (Events - 1)];
+            snprintf(line, sizeof(line), "trace,%u,%u,%c,%s,%s", ev.at, core, ev.phase, ev.task ? ev.task : "?", ev.name);
+            out(line);
+        }
+    }
+    out("trace end");
+    _enable = e;
+}
+//
+}
+#endif
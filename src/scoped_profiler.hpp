@@ -50,10 +50,86 @@ using Cycle = EspCycle; // Unit:us
 #define GOB_CONCAT_AGAIN(a,b) a ## b
 #define GOB_CONCAT(a,b) GOB_CONCAT_AGAIN(a,b)
 
-#ifdef ENABLE_PROFILE
+// Also measured for the telemetry
+#if defined(ENABLE_PROFILE) || defined(ENABLE_TELEMETRY)
 # define ScopedProfile(val) gob::Cycle GOB_CONCAT(pf_, __LINE__) ((val))
 #else
 # define ScopedProfile(val) /* nop */
 #endif
 
+// Timeline of the begin/end events (ENABLE_TRACE)
+// Each core writes to its own ring, the dump is converted to Chrome trace_event JSON by script/trace.py
+#if defined(ENABLE_TRACE)
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#ifndef TRACE_EVENTS
+# define TRACE_EVENTS (512) // Per core, must be power of 2
+#endif
+
+namespace gob
+{
+
+class Trace
+{
+  public:
+    static constexpr uint32_t Events = TRACE_EVENTS;
+    static_assert(Events && !(Events & (Events - 1)), "TRACE_EVENTS must be power of 2");
+
+    // name and the name of the task must be static strings
+    struct Event
+    {
+        uint32_t at;      // esp_timer (us), common to both cores. (ccount is not)
+        const char* name;
+        const char* task;
+        char phase;       // 'B'egin 'E'nd 'i'nstant
+    };
+
+    // Tasks on the same core may preempt each other, so the slot is taken atomically
+    static void record(const char* name, const char phase)
+    {
+        if(!_enable) { return; }
+        auto& r = _ring[xPortGetCoreID()];
+        uint32_t i = r.widx.fetch_add(1, std::memory_order_relaxed) & (Events - 1);
+        r.events[i] = { (uint32_t)ESP32Clock::raw(), name, pcTaskGetTaskName(nullptr), phase };
+    }
+
+    static void enable(const bool e) { _enable = e; }
+    static void clear();
+    // Output the oldest to the newest of each core. (Recording is stopped while dumping)
+    static void dump(void(*out)(const char*));
+
+  private:
+    struct Ring
+    {
+        std::atomic<uint32_t> widx{};
+        Event events[Events];
+    };
+    static Ring _ring[portNUM_PROCESSORS];
+    static volatile bool _enable;
+};
+
+class ScopedTrace
+{
+  public:
+    explicit ScopedTrace(const char* name) : _name(name) { Trace::record(_name, 'B'); }
+    ~ScopedTrace() { Trace::record(_name, 'E'); }
+  private:
+    const char* _name;
+};
+//
+}
+
+# define TraceScope(name) gob::ScopedTrace GOB_CONCAT(tr_, __LINE__) ((name))
+# define TraceBegin(name) gob::Trace::record((name), 'B')
+# define TraceEnd(name) gob::Trace::record((name), 'E')
+# define TraceInstant(name) gob::Trace::record((name), 'i')
+#else
+# define TraceScope(name) /* nop */
+# define TraceBegin(name) /* nop */
+# define TraceEnd(name) /* nop */
+# define TraceInstant(name) /* nop */
+#endif
+
 #endif
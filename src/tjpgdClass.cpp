@@ -25,10 +25,12 @@
 
 #include "tjpgdClass.h"
 
-#include <string.h> // for memcpy memset
+#include <string.h> // for memcpy memset memchr
+#include <new> // for std::nothrow
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
-#include <freertos/queue.h>
+#include <atomic>
+#include "scoped_profiler.hpp" // for TraceScope
 
 /*-----------------------------------------------*/
 /* Zigzag-order to raster-order conversion table */
@@ -235,6 +237,7 @@ static int create_huffman_tbl (	/* 0:OK, !0:Failed */
         for (size_t i = 0; i < 16; ++i) {		/* Re-build huffman code word table */
             b = pb[i];
             while (b--) *ph++ = hc++;
+            if (hc > (1UL << (i + 1))) return TJpgD::JDR_FMT1;	/* Err: the codes overflow the bit length (would overrun the lookup table) */
             hc <<= 1;
         }
 
@@ -244,6 +247,23 @@ static int create_huffman_tbl (	/* 0:OK, !0:Failed */
         jd->huffdata[num][cls] = pd - 1;
 
         memcpy(pd, data += 16, np);		/* Load decoded data corresponds to each code ward */
+
+#if JD_FASTHUFF
+        /* Create lookup table for the codes up to HUFF_BIT bits (0xFFFF: longer code) */
+        uint16_t* lut = (uint16_t*)alloc_pool(jd, (1 << HUFF_BIT) * sizeof(uint16_t));
+        if (!lut) return TJpgD::JDR_MEM1;			/* Err: not enough memory */
+        jd->hufflut[num][cls] = lut;
+        memset(lut, 0xFF, (1 << HUFF_BIT) * sizeof(uint16_t));
+        ph = jd->huffcode[num][cls] + 1;
+        for (uint_fast16_t bl = 1, j = 0; bl <= HUFF_BIT; ++bl) {
+            for (b = pb[bl - 1]; b; --b, ++j) {
+                uint_fast16_t span = 1 << (HUFF_BIT - bl);
+                uint16_t* p = lut + (ph[j] << (HUFF_BIT - bl));
+                uint16_t v = (bl << 8) | pd[j];		/* Code length and decoded data */
+                do { *p++ = v; } while (--span);
+            }
+        }
+#endif
         data += np;
     } while (ndata -= 17 + np);
 
@@ -253,25 +273,147 @@ static int create_huffman_tbl (	/* 0:OK, !0:Failed */
 
 
 
+#if JD_FASTHUFF
+
+/*-----------------------------------------------------------------------*/
+/* Fill the 32-bit bit buffer (25 bits or more are available on return)  */
+/*-----------------------------------------------------------------------*/
+
+static int_fast16_t fill_bits (	/* 0: OK, <0: error code */
+    TJpgDSession* jd		/* Pointer to the decompressor session */
+                               )
+{
+    uint_fast8_t wbit = jd->dbit;
+    uint32_t w = jd->wreg;
+    uint8_t *dp = jd->dptr;		/* Last read byte */
+    uint8_t *dpend = jd->dpend;
+
+    do {
+        uint_fast8_t d = 0xFF;	/* Padding after the marker */
+        if (!jd->marker) {
+            if (wbit <= 8 && dpend - dp > 3) {	/* Take 3 bytes at once if there is no flag sequence */
+                uint32_t v = ((uint32_t)dp[1] << 16) | ((uint32_t)dp[2] << 8) | dp[3];
+                uint32_t t = ~v & 0xFFFFFF;
+                if (!((t - 0x010101) & ~t & 0x808080)) {
+                    w = (w << 24) | v;
+                    wbit += 24;
+                    dp += 3;
+                    break;
+                }
+            }
+            if (++dp == dpend) {	/* No input data is available, re-fill input buffer */
+                dp = jd->inbuf;
+                jd->dpend = dpend = dp + jd->infunc(jd->owner, dp, TJPGD_SZBUF);
+                if (dp == dpend) return 0 - (int_fast16_t)TJpgD::JDR_INP;	/* Err: read error or wrong stream termination */
+            }
+            d = *dp;
+            if (d == 0xFF) {		/* Is start of flag sequence? */
+                if (++dp == dpend) {	/* No input data is available, re-fill input buffer */
+                    dp = jd->inbuf;
+                    jd->dpend = dpend = dp + jd->infunc(jd->owner, dp, TJPGD_SZBUF);
+                    if (dp == dpend) return 0 - (int_fast16_t)TJpgD::JDR_INP;	/* Err: read error or wrong stream termination */
+                }
+                if (*dp) jd->marker = *dp;	/* Marker is detected (RSTn or EOI), it is processed at restart */
+            }
+        }
+        w = (w << 8) | d;
+        wbit += 8;
+    } while (wbit <= 24);
+
+    jd->dptr = dp;
+    jd->wreg = w;
+    jd->dbit = wbit;
+    return 0;
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Extract N bits from input stream                                      */
 /*-----------------------------------------------------------------------*/
 
 static inline int_fast16_t bitext (	/* >=0: extracted data, <0: error code */
-    TJpgD* jd,		/* Pointer to the decompressor object */
+    TJpgDSession* jd,		/* Pointer to the decompressor session */
+    int_fast16_t nbit		/* Number of bits to extract (1 to 11) */
+                                        )
+{
+    if (jd->dbit < nbit) {
+        int_fast16_t rc = fill_bits(jd);
+        if (rc) return rc;
+    }
+    uint_fast8_t wbit = jd->dbit - nbit;
+    jd->dbit = wbit;
+    return (jd->wreg >> wbit) & ((1 << nbit) - 1);	/* Get bits */
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Extract a huffman decoded data from input stream                      */
+/*-----------------------------------------------------------------------*/
+
+static inline int_fast16_t huffext (	/* >=0: decoded data, <0: error code */
+    TJpgDSession* jd,				/* Pointer to the decompressor session */
+    uint_fast8_t id,		/* Table ID (0:Y, 1:C) */
+    uint_fast8_t cls		/* Table class (0:DC, 1:AC) */
+                                )
+{
+    if (jd->dbit < 16) {	/* Prepare bits for the longest code */
+        int_fast16_t rc = fill_bits(jd);
+        if (rc) return rc;
+    }
+    uint_fast8_t wbit = jd->dbit;
+    uint32_t w = jd->wreg;
+
+    /* Most of the codes are decoded by a single lookup */
+    uint_fast16_t d = jd->hufflut[id][cls][(w >> (wbit - HUFF_BIT)) & ((1 << HUFF_BIT) - 1)];
+    if (d != 0xFFFF) {
+        jd->dbit = wbit - (d >> 8);
+        return d & 0xFF;
+    }
+
+    /* Search the codes longer than HUFF_BIT */
+    const uint8_t* hb = jd->huffbits[id][cls] + 1;
+    const uint16_t* hc = jd->huffcode[id][cls] + 1;
+    const uint8_t* hd = jd->huffdata[id][cls] + 1;
+    uint_fast16_t skip = 0;
+    for (uint_fast8_t bl = 0; bl < HUFF_BIT; ++bl) skip += hb[bl];
+    hc += skip; hd += skip;
+    for (uint_fast8_t bl = HUFF_BIT + 1; bl <= 16; ++bl) {
+        uint_fast16_t v = (w >> (wbit - bl)) & ((1 << bl) - 1);
+        for (uint_fast8_t nc = hb[bl - 1]; nc; --nc, ++hc, ++hd) {
+            if (v == *hc) {	/* Matched? */
+                jd->dbit = wbit - bl;
+                return *hd;
+            }
+        }
+    }
+    return 0 - (int_fast16_t)TJpgD::JDR_FMT1;	/* Err: code not found (may be collapted data) */
+}
+
+#else	/* JD_FASTHUFF */
+
+/*-----------------------------------------------------------------------*/
+/* Extract N bits from input stream                                      */
+/*-----------------------------------------------------------------------*/
+
+static inline int_fast16_t bitext (	/* >=0: extracted data, <0: error code */
+    TJpgDSession* jd,		/* Pointer to the decompressor session */
     int_fast16_t nbit		/* Number of bits to extract (1 to 11) */
                                         )
 {
     uint_fast8_t msk = jd->dbit;
     uint8_t *dp = jd->dptr;
-    uint32_t w = *dp;
+    uint32_t w = jd->dval;
 
     if (msk < nbit) {
         do {				/* Next byte? */
             uint8_t *dpend = jd->dpend;
             if (++dp == dpend) {	/* No input data is available, re-fill input buffer */
                 dp = jd->inbuf;	/* Top of input buffer */
-                dpend = dp + jd->infunc(jd, dp, TJPGD_SZBUF);
+                dpend = dp + jd->infunc(jd->owner, dp, TJPGD_SZBUF);
                 if (dp == dpend) return 0 - (int_fast16_t)TJpgD::JDR_INP;	/* Err: read error or wrong stream termination */
                 jd->dpend = dpend;
             }
@@ -280,14 +422,14 @@ static inline int_fast16_t bitext (	/* >=0: extracted data, <0: error code */
             if (s == 0xff) {		/* Is start of flag sequence? */
                 if (++dp == dpend) {	/* No input data is available, re-fill input buffer */
                     dp = jd->inbuf;	/* Top of input buffer */
-                    dpend = dp + jd->infunc(jd, dp, TJPGD_SZBUF);
+                    dpend = dp + jd->infunc(jd->owner, dp, TJPGD_SZBUF);
                     if (dp == dpend) return 0 - (int_fast16_t)TJpgD::JDR_INP;	/* Err: read error or wrong stream termination */
                     jd->dpend = dpend;
                 }
                 if (*dp != 0) return 0 - (int_fast16_t)TJpgD::JDR_FMT1;	/* Err: unexpected flag is detected (may be collapted data) */
-                *dp = 0xff;			/* The flag is a data 0xFF */
             }
             jd->dptr = dp;
+            jd->dval = s;		/* The flag is a data 0xFF (Input buffer is not rewritten) */
             msk += 8;			/* Read from MSB */
         } while (msk < nbit);
     }
@@ -304,15 +446,17 @@ static inline int_fast16_t bitext (	/* >=0: extracted data, <0: error code */
 /*-----------------------------------------------------------------------*/
 
 static int_fast16_t huffext (	/* >=0: decoded data, <0: error code */
-    TJpgD* jd,				/* Pointer to the decompressor object */
-    const uint8_t* hb,	/* Pointer to the bit distribution table */
-    const uint16_t* hc,	/* Pointer to the code word table */
-    const uint8_t* hd	/* Pointer to the data table */
+    TJpgDSession* jd,				/* Pointer to the decompressor session */
+    uint_fast8_t id,		/* Table ID (0:Y, 1:C) */
+    uint_fast8_t cls		/* Table class (0:DC, 1:AC) */
                                 )
 {
+    const uint8_t* hb = jd->huffbits[id][cls];	/* Bit distribution table */
+    const uint16_t* hc = jd->huffcode[id][cls];	/* Code word table */
+    const uint8_t* hd = jd->huffdata[id][cls];	/* Data table */
     const uint8_t* hb_end = hb + 17;
     uint_fast8_t msk = jd->dbit; 
-    uint_fast16_t w = *jd->dptr & ((1ul << msk) - 1);
+    uint_fast16_t w = jd->dval & ((1ul << msk) - 1);
     for (;;) {
         if (!msk) {				/* Next byte? */
             uint8_t *dp = jd->dptr;
@@ -320,7 +464,7 @@ static int_fast16_t huffext (	/* >=0: decoded data, <0: error code */
             msk = 8;
             if (++dp == dpend) {			/* No input data is available, re-fill input buffer */
                 dp = jd->inbuf;	/* Top of input buffer */
-                jd->dpend = dpend = dp + jd->infunc(jd, dp, TJPGD_SZBUF);
+                jd->dpend = dpend = dp + jd->infunc(jd->owner, dp, TJPGD_SZBUF);
                 if (dp == dpend) return 0 - (int_fast16_t)TJpgD::JDR_INP;	/* Err: read error or wrong stream termination */
             }
             uint_fast8_t s = *dp;
@@ -328,13 +472,13 @@ static int_fast16_t huffext (	/* >=0: decoded data, <0: error code */
             if (s == 0xFF) {		/* Is start of flag sequence? */
                 if (++dp == dpend) {			/* No input data is available, re-fill input buffer */
                     dp = jd->inbuf;	/* Top of input buffer */
-                    jd->dpend = dpend = dp + jd->infunc(jd, dp, TJPGD_SZBUF);
+                    jd->dpend = dpend = dp + jd->infunc(jd->owner, dp, TJPGD_SZBUF);
                     if (dp == dpend) return 0 - (int_fast16_t)TJpgD::JDR_INP;	/* Err: read error or wrong stream termination */
                 }
                 if (*dp != 0) return 0 - (int_fast16_t)TJpgD::JDR_FMT1;	/* Err: unexpected flag is detected (may be collapted data) */
-                *dp = 0xFF;			/* The flag is a data 0xFF */
             }
             jd->dptr = dp;
+            jd->dval = s;			/* The flag is a data 0xFF (Input buffer is not rewritten) */
         }
         do {
             uint_fast16_t v = w >> --msk;
@@ -353,11 +497,19 @@ huffext_match:
     return *++hd;					/* Return the decoded data */
 }
 
+#endif	/* JD_FASTHUFF */
+
 /*-----------------------------------------------------------------------*/
 /* Apply Inverse-DCT in Arai Algorithm (see also aa_idct.png)            */
 /*-----------------------------------------------------------------------*/
-
-static void block_idct (
+/*
+  N is the number of the elements in each row and column that can be
+  non-zero (8: all, 4: only the upper left 4x4 elements).
+  The zero elements are not loaded, and the columns of them are not
+  processed. The result is the same as N = 8.
+*/
+
+template <uint_fast8_t N> static void block_idct (
     int32_t* src,	/* Input block data (de-quantized and pre-scaled for Arai Algorithm) */
     jd_yuv_t* dst	/* Pointer to the destination to store the block as byte array */
                         )
@@ -369,15 +521,15 @@ static void block_idct (
     int32_t t10, t11, t12, t13;
 
     /* Process columns */
-    for (size_t i = 0; i < 8; ++i) {
+    for (size_t i = 0; i < N; ++i) {
         /* Get and Process the even elements */
         t12 = src[8 * 0];
-        t10 = src[8 * 4];
+        t10 = (N > 4) ? src[8 * 4] : 0;
         t10 += t12;
         t12 = (t12 << 1) - t10;
 
         t11 = src[8 * 2];
-        t13 = src[8 * 6];
+        t13 = (N > 4) ? src[8 * 6] : 0;
         t13 += t11;
         t11 = (t11 << 1) - t13;
         t11 = t11 * M13 >> 8;
@@ -390,12 +542,12 @@ static void block_idct (
 
         /* Get and Process the odd elements */
         v4 = src[8 * 1];
-        v5 = src[8 * 7];
+        v5 = (N > 4) ? src[8 * 7] : 0;
         v5 += v4;
         v4 = (v4 << 1) - v5;
 
         v7 = src[8 * 3];
-        v6 = src[8 * 5];
+        v6 = (N > 4) ? src[8 * 5] : 0;
         v6 -= v7;
         v7 = (v7 << 1) + v6;
         v7 += v5;
@@ -426,16 +578,16 @@ static void block_idct (
     }
 
     /* Process rows */
-    src -= 8;
+    src -= N;
     for (size_t i = 0; i < 8; ++i) {
         /* Get and Process the even elements */
         t12 = src[0] + (128L << 8);	/* remove DC offset (-128) here */
-        t10 = src[4];
+        t10 = (N > 4) ? src[4] : 0;
         t10 += t12;
         t12 = (t12 << 1) - t10;
 
         t11 = src[2];
-        t13 = src[6];
+        t13 = (N > 4) ? src[6] : 0;
         t13 += t11;
         t11 = (t11 << 1) - t13;
         t11 = t11 * M13 >> 8;
@@ -448,12 +600,12 @@ static void block_idct (
 
         /* Get and Process the odd elements */
         v4 = src[1];
-        v5 = src[7];
+        v5 = (N > 4) ? src[7] : 0;
         v5 += v4;
         v4 = (v4 << 1) - v5;
 
         v7 = src[3];
-        v6 = src[5];
+        v6 = (N > 4) ? src[5] : 0;
         v6 -= v7;
         v7 = (v7 << 1) + v6;
         v7 += v5;
@@ -498,22 +650,104 @@ static void block_idct (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Apply reduced Inverse-DCT for scaled output (1/2 and 1/4)             */
+/*-----------------------------------------------------------------------*/
+/*
+  With the coefficients pre-scaled for Arai algorithm, the average of the
+  2 (or 4) neighboring pixels is given by the 4-point (or 2-point) IDCT of
+  the low frequency coefficients. (The higher ones are ignored)
+  The output is stored with the same row pitch (8) as block_idct.
+*/
+
+static void block_idct_4x4 (
+    int32_t* src,	/* Input block data (de-quantized and pre-scaled for Arai Algorithm) */
+    jd_yuv_t* dst	/* Pointer to the destination to store the 4x4 block */
+                            )
+{
+    const int32_t C1 = (int32_t)(0.92388*256), C2 = (int32_t)(0.70711*256), C3 = (int32_t)(0.38268*256);
+    int32_t e0, e1, o0, o1;
+
+    /* Process columns */
+    for (size_t i = 0; i < 4; ++i) {
+        e0 = src[8 * 2] * C2 >> 8;
+        e1 = src[8 * 0] - e0;
+        e0 += src[8 * 0];
+        o0 = (src[8 * 1] * C1 + src[8 * 3] * C3) >> 8;
+        o1 = (src[8 * 1] * C3 - src[8 * 3] * C1) >> 8;
+        src[8 * 0] = e0 + o0;
+        src[8 * 3] = e0 - o0;
+        src[8 * 1] = e1 + o1;
+        src[8 * 2] = e1 - o1;
+        ++src;	/* Next column */
+    }
+
+    /* Process rows */
+    src -= 4;
+    for (size_t i = 0; i < 4; ++i) {
+        e0 = src[2] * C2 >> 8;
+        e1 = src[0] + (128L << 8) - e0;	/* remove DC offset (-128) here */
+        e0 += src[0] + (128L << 8);
+        o0 = (src[1] * C1 + src[3] * C3) >> 8;
+        o1 = (src[1] * C3 - src[3] * C1) >> 8;
+#if JD_FASTDECODE >= 1
+        dst[0] = (int16_t)((e0 + o0) >> 8);
+        dst[3] = (int16_t)((e0 - o0) >> 8);
+        dst[1] = (int16_t)((e1 + o1) >> 8);
+        dst[2] = (int16_t)((e1 - o1) >> 8);
+#else
+        dst[0] = BYTECLIP((e0 + o0) >> 8);
+        dst[3] = BYTECLIP((e0 - o0) >> 8);
+        dst[1] = BYTECLIP((e1 + o1) >> 8);
+        dst[2] = BYTECLIP((e1 - o1) >> 8);
+#endif
+        dst += 8;
+        src += 8;	/* Next row */
+    }
+}
+
+static void block_idct_2x2 (
+    int32_t* src,	/* Input block data (de-quantized and pre-scaled for Arai Algorithm) */
+    jd_yuv_t* dst	/* Pointer to the destination to store the 2x2 block */
+                            )
+{
+    const int32_t C = (int32_t)(0.65328*256);	/* cos(pi/8) * cos(pi/4) */
+    int32_t t0 = src[0] + (128L << 8), t1 = src[1] * C >> 8;	/* remove DC offset (-128) here */
+    int32_t t8 = src[8] * C >> 8, t9 = (src[9] * C >> 8) * C >> 8;
+
+    int32_t e = t0 + t8, o = t1 + t9;	/* Upper row */
+#if JD_FASTDECODE >= 1
+    dst[0] = (int16_t)((e + o) >> 8);
+    dst[1] = (int16_t)((e - o) >> 8);
+#else
+    dst[0] = BYTECLIP((e + o) >> 8);
+    dst[1] = BYTECLIP((e - o) >> 8);
+#endif
+    e = t0 - t8; o = t1 - t9;			/* Lower row */
+#if JD_FASTDECODE >= 1
+    dst[8] = (int16_t)((e + o) >> 8);
+    dst[9] = (int16_t)((e - o) >> 8);
+#else
+    dst[8] = BYTECLIP((e + o) >> 8);
+    dst[9] = BYTECLIP((e - o) >> 8);
+#endif
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Load all blocks in the MCU into working buffer                        */
 /*-----------------------------------------------------------------------*/
 static TJpgD::JRESULT mcu_load (
-    TJpgD* jd,		/* Pointer to the decompressor object */
+    TJpgDSession* jd,		/* Pointer to the decompressor session */
     jd_yuv_t* bp,		/* mcubuf */
     int32_t* tmp	/* Block working buffer for de-quantize and IDCT */
                                 )
 {
     int_fast16_t b, d, e;
-    uint_fast8_t blk, nby, nbc, i, z;
-    const uint8_t *hb, *hd;
-    const uint16_t *hc;
+    uint_fast8_t blk, nby, nbc, i, z, last;
 
-    z = 0;
-        
     nby = jd->msx * jd->msy;	/* Number of Y blocks (1, 2 or 4) */
     nbc = jd->comps_in_frame - 1;	/* Number of C blocks (2 or 0(grayscale)) */
 
@@ -522,11 +756,12 @@ static TJpgD::JRESULT mcu_load (
         uint_fast8_t id = cmp ? 1 : 0;						/* Huffman table ID of the component */
 
         /* Extract a DC element from input stream */
-        hb = jd->huffbits[id][0];				/* Huffman table for the DC element */
-        hc = jd->huffcode[id][0];
-        hd = jd->huffdata[id][0];
-        b = huffext(jd, hb, hc, hd);			/* Extract a huffman coded data (bit length) */
+        b = huffext(jd, id, 0);					/* Extract a huffman coded data (bit length) */
         if (b < 0) return (TJpgD::JRESULT)(-b);		/* Err: invalid code or input */
+#if JD_COSTCOUNT
+        jd->cost.symbols++;
+        jd->cost.blocks++;
+#endif
         d = jd->dcv[cmp];						/* DC value of previous block */
         if (b) {								/* If there is any difference from previous block */
             e = bitext(jd, b);					/* Extract data bits */
@@ -541,34 +776,56 @@ static TJpgD::JRESULT mcu_load (
 
         /* Extract following 63 AC elements from input stream */
         memset(&tmp[1], 0, 4 * 63);				/* Clear rest of elements */
-        hb = jd->huffbits[id][1];				/* Huffman table for the AC elements */
-        hc = jd->huffcode[id][1];
-        hd = jd->huffdata[id][1];
+        last = 0;				/* Zigzag index of the last non-zero element */
         i = 1;					/* Top of the AC elements */
         do {
-            b = huffext(jd, hb, hc, hd);		/* Extract a huffman coded value (zero runs and bit length) */
+            b = huffext(jd, id, 1);				/* Extract a huffman coded value (zero runs and bit length) */
+#if JD_COSTCOUNT
+            jd->cost.symbols++;
+#endif
             if (b == 0) break;					/* EOB? */
             if (b < 0) return (TJpgD::JRESULT)(-b);	/* Err: invalid code or input error */
             i += b >> 4;
             if (b &= 0x0F) {					/* Bit length */
+#if JD_COSTCOUNT
+                jd->cost.nonzero++;
+#endif
                 d = bitext(jd, b);				/* Extract data bits */
                 if (d < 0) return (TJpgD::JRESULT)(-d);/* Err: input device */
                 b = 1 << (b - 1);				/* MSB position */
                 if (!(d & b)) d -= (b << 1) - 1;/* Restore negative value if needed */
                 z = ZIG(i);						/* Zigzag-order to raster-order converted index */
                 tmp[z] = d * dqf[z] >> 8;		/* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
+                last = i;
             }
         } while (++i != 64);		/* Next AC element */
+#if !JD_IDCTDISPATCH
+        last = 63;				/* Full IDCT for all the blocks */
+#endif
 
-        if (z == 1) {	/* If no AC element or scale ratio is 1/8, IDCT can be ommited and the block is filled with DC value */
-            d = (jd_yuv_t)((*tmp / 256) + 128);
+        if (jd->scale == 3) {	/* If scale ratio is 1/8, IDCT can be ommited and only DC element is used */
+            *bp = (jd_yuv_t)((*tmp / 256) + 128);
+        } else if (last == 0) {	/* If no AC element, IDCT can be ommited and the block is filled with DC value */
+            d = (jd_yuv_t)((*tmp >> 8) + 128);	/* Same as the result of IDCT */
             if (JD_FASTDECODE >= 1) {
                 for (i = 0; i < 64; bp[i++] = d) ;
             } else {
                 memset(bp, d, 64);
             }
+        } else if (jd->scale == 1) {
+            block_idct_4x4(tmp, bp);	/* Apply reduced IDCT (1/2) */
+        } else if (jd->scale == 2) {
+            block_idct_2x2(tmp, bp);	/* Apply reduced IDCT (1/4) */
+        } else if (last < 10) {	/* Zigzag index 0-9 are in the upper left 4x4 */
+            block_idct<4>(tmp, bp);	/* Apply IDCT for the low-order elements */
+#if JD_COSTCOUNT
+            jd->cost.idct4++;
+#endif
         } else {
-            block_idct(tmp, bp);		/* Apply IDCT and store the block to the MCU buffer */
+            block_idct<8>(tmp, bp);		/* Apply IDCT and store the block to the MCU buffer */
+#if JD_COSTCOUNT
+            jd->cost.idct8++;
+#endif
         }
 
         bp += 64;				/* Next block */
@@ -581,41 +838,145 @@ static TJpgD::JRESULT mcu_load (
 
 
 /*-----------------------------------------------------------------------*/
-/* Output an MCU: Convert YCrCb to RGB and output it in RGB form         */
+/* Skip an MCU: Extract the huffman coded data without IDCT              */
 /*-----------------------------------------------------------------------*/
 
-static TJpgD::JRESULT mcu_output (
+static TJpgD::JRESULT mcu_skip (
+    TJpgDSession* jd		/* Pointer to the decompressor session */
+                                )
+{
+    int_fast16_t b, d, e;
+    uint_fast8_t blk, nby, nbc, i;
+
+    nby = jd->msx * jd->msy;	/* Number of Y blocks (1, 2 or 4) */
+    nbc = jd->comps_in_frame - 1;	/* Number of C blocks (2 or 0(grayscale)) */
+
+    for (blk = 0; blk < nby + nbc; blk++) {
+        uint_fast8_t cmp = (blk < nby) ? 0 : blk - nby + 1;	/* Component number 0:Y, 1:Cb, 2:Cr */
+        uint_fast8_t id = cmp ? 1 : 0;						/* Huffman table ID of the component */
+
+        /* Extract a DC element to keep the DC prediction of the following blocks */
+        b = huffext(jd, id, 0);
+        if (b < 0) return (TJpgD::JRESULT)(-b);
+#if JD_COSTCOUNT
+        jd->cost.symbols++;
+#endif
+        if (b) {
+            e = bitext(jd, b);
+            if (e < 0) return (TJpgD::JRESULT)(-e);
+            d = 1 << (b - 1);
+            if (!(e & d)) e -= (d << 1) - 1;
+            jd->dcv[cmp] += e;
+        }
+
+        /* Discard following 63 AC elements */
+        i = 1;
+        do {
+            b = huffext(jd, id, 1);
+#if JD_COSTCOUNT
+            jd->cost.symbols++;
+#endif
+            if (b == 0) break;					/* EOB? */
+            if (b < 0) return (TJpgD::JRESULT)(-b);
+            i += b >> 4;
+            if (b &= 0x0F) {
+                d = bitext(jd, b);
+                if (d < 0) return (TJpgD::JRESULT)(-d);
+            }
+        } while (++i != 64);
+    }
+
+    return TJpgD::JDR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Convert YCrCb to the output pixel format                              */
+/*-----------------------------------------------------------------------*/
+
+/* Store a pixel and return the next pointer */
+template <uint_fast8_t Format> static inline uint8_t* store_pixel (uint8_t* p, uint_fast8_t r, uint_fast8_t g, uint_fast8_t b);
+
+template <> inline uint8_t* store_pixel<TJpgD::JDF_RGB888> (uint8_t* p, uint_fast8_t r, uint_fast8_t g, uint_fast8_t b)
+{
+    p[0] = r;
+    p[1] = g;
+    p[2] = b;
+    return p + 3;
+}
+
+template <> inline uint8_t* store_pixel<TJpgD::JDF_SWAP565> (uint8_t* p, uint_fast8_t r, uint_fast8_t g, uint_fast8_t b)
+{
+    p[0] = (r & 0xF8) | (g >> 5);			/* RRRRRGGG */
+    p[1] = ((g << 3) & 0xE0) | (b >> 3);	/* GGGBBBBB */
+    return p + 2;
+}
+
+template <uint_fast8_t Format> static void mcu_convert (
     TJpgD* jd,		/* Pointer to the decompressor object */
     jd_yuv_t* mcubuf,
     uint8_t* workbuf,
-    uint32_t (*outfunc)(TJpgD*, void*, TJpgD::JRECT*),	/* RGB output function */
-    uint_fast16_t x,		/* MCU position in the image (left of the MCU) */
-    uint_fast16_t y		/* MCU position in the image (top of the MCU) */
-                                  )
+    uint_fast16_t mx,	/* MCU size (pixel) */
+    uint_fast16_t my
+                                                       )
 {
-    uint_fast16_t ix, iy, mx, my, rx, ry;
+    uint_fast16_t ix, iy;
     jd_yuv_t *py, *pc;
-    TJpgD::JRECT rect;
-
-    mx = jd->msx * 8; my = jd->msy * 8;					/* MCU size (pixel) */
-    rx = (x + mx <= jd->width) ? mx : jd->width - x;	/* Output rectangular size (it may be clipped at right/bottom end) */
-    ry = (y + my <= jd->height) ? my : jd->height - y;
-
-    rect.left = x; rect.right = x + rx - 1;				/* Rectangular area in the frame buffer */
-    rect.top = y; rect.bottom = y + ry - 1;
 
+#if JD_FIXEDCOLOR
+    /* Coefficients in Q16 fixed-point */
+    static constexpr int32_t frr = (int32_t)(1.402   * 65536 + 0.5);
+    static constexpr int32_t fgr = (int32_t)(0.71414 * 65536 + 0.5);
+    static constexpr int32_t fgb = (int32_t)(0.34414 * 65536 + 0.5);
+    static constexpr int32_t fbb = (int32_t)(1.772   * 65536 + 0.5);
+    static constexpr int32_t fround = 1 << 15;
+#else
     static constexpr float frr = 1.402;
     static constexpr float fgr = 0.71414;
     static constexpr float fgb = 0.34414;
     static constexpr float fbb = 1.772;
+#endif
 
     /* Build an RGB MCU from discrete comopnents */
     const int8_t* btbase = Bayer[jd->bayer];
     const int8_t* btbl;
-    uint_fast8_t ixshift = (mx == 16);
-    uint_fast8_t iyshift = (my == 16);
+    uint_fast8_t ixshift = (jd->msx == 2);
+    uint_fast8_t iyshift = (jd->msy == 2);
     iy = 0;
     uint8_t* prgb = workbuf;
+
+    if (jd->scale) {	/* Scaled blocks (bs x bs pixels in each block, the row pitch is 8) */
+        uint_fast8_t bshift = 3 - jd->scale;
+        uint_fast8_t bmask = (1 << bshift) - 1;
+        jd_yuv_t* pcbase = &mcubuf[(jd->msx * jd->msy) << 6];
+        do {
+            btbl = &btbase[(iy & 3) << 3];
+            py = &mcubuf[(((iy >> bshift) * jd->msx) << 6) + ((iy & bmask) << 3)];
+            pc = &pcbase[(iy >> iyshift) << 3];
+            ix = 0;
+            do {
+#if JD_FIXEDCOLOR
+                int32_t cb = (pc[(ix >> ixshift)     ] - 128);
+                int32_t cr = (pc[(ix >> ixshift) + 64] - 128);
+                int32_t gg = (fgb * cb + fgr * cr + fround) >> 16;
+                int32_t rr = (frr * cr + fround) >> 16;
+                int32_t bb = (fbb * cb + fround) >> 16;
+#else
+                float cb = (pc[(ix >> ixshift)     ] - 128);
+                float cr = (pc[(ix >> ixshift) + 64] - 128);
+                int32_t gg = fgb * cb + fgr * cr;
+                int32_t rr = frr * cr;
+                int32_t bb = fbb * cb;
+#endif
+                int32_t yy = btbl[ix & 7] + py[((ix >> bshift) << 6) + (ix & bmask)];
+                prgb = store_pixel<Format>(prgb, BYTECLIP(yy + rr), BYTECLIP(yy - gg), BYTECLIP(yy + bb));
+            } while (++ix != mx);
+        } while (++iy != my);
+        return;
+    }
+
     do {
         btbl = &btbase[(iy & 3) << 3];
         py = &mcubuf[((iy & 8) + iy) << 3];
@@ -623,6 +984,16 @@ static TJpgD::JRESULT mcu_output (
         ix = 0;
         do {
             do {
+#if JD_FIXEDCOLOR
+                int32_t cb = (pc[ 0] - 128); 	/* Get Cb/Cr component and restore right level */
+                int32_t cr = (pc[64] - 128);
+                ++pc;
+
+                /* Convert CbCr to RGB (Rounded, differs from the float path by 1 at most) */
+                int32_t gg = (fgb * cb + fgr * cr + fround) >> 16;
+                int32_t rr = (frr * cr + fround) >> 16;
+                int32_t bb = (fbb * cb + fround) >> 16;
+#else
                 float cb = (pc[ 0] - 128); 	/* Get Cb/Cr component and restore right level */
                 float cr = (pc[64] - 128);
                 ++pc;
@@ -631,17 +1002,13 @@ static TJpgD::JRESULT mcu_output (
                 int32_t gg = fgb * cb + fgr * cr;
                 int32_t rr = frr * cr;
                 int32_t bb = fbb * cb;
+#endif
                 int32_t yy = btbl[0] + py[0];			/* Get Y component */
-                prgb[0] = BYTECLIP(yy + rr);
-                prgb[1] = BYTECLIP(yy - gg);
-                prgb[2] = BYTECLIP(yy + bb);
+                prgb = store_pixel<Format>(prgb, BYTECLIP(yy + rr), BYTECLIP(yy - gg), BYTECLIP(yy + bb));
                 if (ixshift) {
                     yy = btbl[1] + py[1];			/* Get Y component */
-                    prgb[3] = BYTECLIP(yy + rr);
-                    prgb[4] = BYTECLIP(yy - gg);
-                    prgb[5] = BYTECLIP(yy + bb);
+                    prgb = store_pixel<Format>(prgb, BYTECLIP(yy + rr), BYTECLIP(yy - gg), BYTECLIP(yy + bb));
                 }
-                prgb += 3 << ixshift;
                 btbl += 1 << ixshift;
                 py += 1 << ixshift;
                 ix += 1 << ixshift;
@@ -650,21 +1017,105 @@ static TJpgD::JRESULT mcu_output (
             py += 64 - 8;	/* Jump to next block if double block heigt */
         } while (ix != mx);
     } while (++iy != my);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Output an MCU: Convert YCrCb to RGB and output it in RGB form         */
+/*-----------------------------------------------------------------------*/
+
+static TJpgD::JRESULT mcu_output (
+    TJpgD* jd,		/* Pointer to the decompressor object */
+    jd_yuv_t* mcubuf,
+    uint8_t* workbuf,
+    uint32_t (*outfunc)(TJpgD*, void*, TJpgD::JRECT*),	/* RGB output function */
+    uint_fast16_t x,		/* MCU position in the image (left of the MCU) */
+    uint_fast16_t y		/* MCU position in the image (top of the MCU) */
+                                  )
+{
+    uint_fast16_t mx, my, rx, ry;
+    TJpgD::JRECT rect;
+
+    mx = jd->msx * 8; my = jd->msy * 8;					/* MCU size (pixel) */
+    rx = (x + mx <= jd->width) ? mx : jd->width - x;	/* Output rectangular size (it may be clipped at right/bottom end) */
+    ry = (y + my <= jd->height) ? my : jd->height - y;
+
+    if (jd->scale) {	/* To output coordinates */
+        uint_fast8_t s = jd->scale;
+        uint_fast16_t r = (1 << s) - 1;
+        x >>= s; y >>= s;
+        rx = (rx + r) >> s; ry = (ry + r) >> s;
+        mx >>= s; my >>= s;
+    }
+
+    rect.left = x; rect.right = x + rx - 1;				/* Rectangular area in the frame buffer */
+    rect.top = y; rect.bottom = y + ry - 1;
+
+    uint_fast8_t bpp;	/* Bytes per pixel */
+    if (jd->format == TJpgD::JDF_SWAP565) {
+        mcu_convert<TJpgD::JDF_SWAP565>(jd, mcubuf, workbuf, mx, my);
+        bpp = 2;
+    } else {
+        mcu_convert<TJpgD::JDF_RGB888>(jd, mcubuf, workbuf, mx, my);
+        bpp = 3;
+    }
 
     if (rx < mx) {
         uint8_t *s, *d;
         s = d = (uint8_t*)workbuf;
-        rx *= 3;
-        mx *= 3;
+        rx *= bpp;
+        mx *= bpp;
         for (size_t y = 1; y < ry; ++y)
         {
-            memcpy(d += rx, s += mx, rx);	/* Copy effective pixels */
+            memmove(d += rx, s += mx, rx);	/* Copy effective pixels (overlapped) */
         }
     }
     /* Output the RGB rectangular */
     return outfunc(jd, workbuf, &rect) ? TJpgD::JDR_OK : TJpgD::JDR_INTR; 
 }
 
+/*-----------------------------------------------------------------------*/
+/* Convert lines for linefunc to output coordinates                      */
+/*-----------------------------------------------------------------------*/
+
+static inline void scale_lines (
+    const TJpgD* jd,	/* Pointer to the decompressor object */
+    uint_fast16_t& y,	/* Top line (in/out) */
+    uint_fast16_t& h	/* Number of lines (in/out) */
+                                )
+{
+    if (jd->scale) {
+        uint_fast8_t s = jd->scale;
+        uint_fast16_t bottom = (y + h + (1 << s) - 1) >> s;
+        y >>= s;
+        h = bottom - y;
+    }
+}
+
+/*-----------------------------------------------------------------------*/
+/* Get the viewport in the input image coordinates                      */
+/*-----------------------------------------------------------------------*/
+
+static inline bool source_viewport (
+    const TJpgD* jd,	/* Pointer to the decompressor object */
+    TJpgD::JRECT& vp	/* Viewport (out) */
+                                   )
+{
+    const TJpgD::JRECT& v = jd->viewport;
+    if (v.left > v.right || v.top > v.bottom || v.right < 0 || v.bottom < 0) return false;
+
+    uint_fast8_t s = jd->scale;
+    vp.left = v.left << s;
+    vp.top = v.top << s;
+    vp.right = ((v.right + 1) << s) - 1;
+    vp.bottom = ((v.bottom + 1) << s) - 1;
+    if (vp.right >= jd->width) vp.right = jd->width - 1;
+    if (vp.bottom >= jd->height) vp.bottom = jd->height - 1;
+    return true;
+}
+
 /*-----------------------------------------------------------------------*/
 /* Process restart interval                                              */
 /*-----------------------------------------------------------------------*/
@@ -681,6 +1132,12 @@ static TJpgD::JRESULT restart (
     /* Discard padding bits and get two bytes from the input stream */
     dp = jd->dptr; dpend = jd->dpend;
     d = 0;
+#if JD_FASTHUFF
+    if (jd->marker) {	/* The marker has been detected by fill_bits */
+        d = 0xFF00 | jd->marker;
+        jd->marker = 0;
+    } else
+#endif
     for (size_t i = 0; i < 2; i++) {
         if (++dp == dpend) {	/* No input data is available, re-fill input buffer */
             dp = jd->inbuf;
@@ -689,7 +1146,7 @@ static TJpgD::JRESULT restart (
         }
         d = (d << 8) | *dp;	/* Get a byte */
     }
-    jd->dptr = dp; jd->dbit = 0;
+    jd->dptr = dp; jd->dbit = 0; jd->dval = 0; jd->wreg = 0;
 
     /* Check the marker */
     if ((d & 0xFFD8) != 0xFFD0 || (d & 7) != (rstn & 7)) {
@@ -714,29 +1171,71 @@ static TJpgD::JRESULT restart (
 
 //#define JD_INNER_BUFFER_SIZE (1024 * 8)
 
+/* Input function for the memory source (All data is given at prepare) */
+static uint32_t mem_infunc (
+    TJpgD* jd,
+    uint8_t* buf,
+    uint32_t len
+                            )
+{
+    (void)jd; (void)buf; (void)len;
+    return 0;	/* No more data */
+}
+
 TJpgD::JRESULT TJpgD::prepare (
     uint32_t (*infunc)(TJpgD*, uint8_t*, uint32_t),	/* JPEG strem input function */
     void* dev			/* I/O device identifier for the session */
                                )
 {
-    uint8_t *seg;
-    uint_fast8_t b, marker;
-    uint_fast16_t i, len;
-    TJpgD::JRESULT rc;
+    init_session(infunc, dev);
+
+    inbuf = dptr = (uint8_t*)alloc_pool(this, TJPGD_SZBUF);		/* Allocate stream input buffer */
+    if (!inbuf) return TJpgD::JDR_MEM1;
+
+    return analyze(infunc(this, dptr, 16));
+}
 
-    static constexpr uint_fast16_t sz_pool = 3900;
-    static uint8_t pool[sz_pool];
+TJpgD::JRESULT TJpgD::prepare (
+    const uint8_t* data,	/* JPEG data on memory (It must be kept until decompression is completed) */
+    uint32_t len,			/* Size of data */
+    void* dev				/* I/O device identifier for the session */
+                               )
+{
+    init_session(mem_infunc, dev);
 
-    this->pool = pool;		/* Work memroy */
-    this->sz_pool = sz_pool;	/* Size of given work memory */
+    /* Decode directly from the data, it is not rewritten */
+    inbuf = dptr = const_cast<uint8_t*>(data);
+    return analyze(len);
+}
+
+void TJpgD::init_session (
+    uint32_t (*infunc)(TJpgD*, uint8_t*, uint32_t),
+    void* dev
+                          )
+{
+    this->pool = workpool;		/* Work memroy */
+    this->sz_pool = sizeof(workpool);	/* Size of given work memory */
     this->infunc = infunc;	/* Stream input function */
+    this->owner = this;
     this->device = dev;		/* I/O device identifier */
     this->nrst = 0;			/* No restart interval (default) */
+    this->viewport.left = this->viewport.top = 0;			/* Whole image (default) */
+    this->viewport.right = this->viewport.bottom = INT16_MAX;
+#if JD_COSTCOUNT
+    memset(&this->cost, 0, sizeof(this->cost));
+#endif
+}
 
-    inbuf = seg = dptr = (uint8_t*)alloc_pool(this, TJPGD_SZBUF);		/* Allocate stream input buffer */
-    if (!seg) return TJpgD::JDR_MEM1;
+TJpgD::JRESULT TJpgD::analyze (
+    uint32_t dctr		/* Number of bytes available from dptr */
+                               )
+{
+    uint8_t *seg;
+    uint_fast8_t b, marker;
+    uint_fast16_t i, len;
+    TJpgD::JRESULT rc;
+    const bool stream = (infunc != mem_infunc);
 
-    uint32_t dctr = infunc(this, dptr, 16);
     seg = dptr;
     if (dctr <= 2) return TJpgD::JDR_INP;/* Check SOI marker */
     if (LDB_WORD(seg) != 0xFFD8) return TJpgD::JDR_FMT1;	/* Err: SOI is not detected */
@@ -745,6 +1244,7 @@ TJpgD::JRESULT TJpgD::prepare (
     for (;;) {
         /* Get a JPEG marker */
         if (dctr < 4) {
+            if (!stream) return TJpgD::JDR_INP;	/* Err: wrong termination of the data */
             if (4 > (TJPGD_SZBUF - (dptr - inbuf))) return TJpgD::JDR_MEM2;
             dctr += infunc(this, dptr + dctr, 4);
             if (dctr < 4) return TJpgD::JDR_INP;
@@ -761,6 +1261,7 @@ TJpgD::JRESULT TJpgD::prepare (
 
         /* Load segment data */
         if (dctr < len) {
+            if (!stream) return TJpgD::JDR_INP;	/* Err: wrong termination of the data */
             if (len - dctr > (TJPGD_SZBUF - (dptr - inbuf))) return TJpgD::JDR_MEM2;
             dctr += infunc(this, dptr + dctr, len - dctr);
             if (dctr < len) return TJpgD::JDR_INP;
@@ -831,6 +1332,9 @@ TJpgD::JRESULT TJpgD::prepare (
             /* Allocate working buffer for MCU and RGB */
             if (!msy || !msx) return TJpgD::JDR_FMT1;					/* Err: SOF0 has not been loaded */
             dbit = 0;
+            dval = 0;
+            wreg = 0;
+            this->marker = 0;	/* (Shadowed by the local marker) */
             dpend = dptr + dctr;
             --dptr;
 
@@ -876,30 +1380,45 @@ TJpgD::JRESULT TJpgD::decomp (
     uint8_t workbuf[768];
     jd_yuv_t mcubuf[384];
     uint8_t yidx = 0;
+    TJpgD::JRECT vp;
+
+    if (scale > 3 || !source_viewport(this, vp)) return TJpgD::JDR_PAR;
+
+    if (comps_in_frame == 1) { /* Erase Cr/Cb for Grayscale */
+        for (size_t i = 0; i < sizeof(mcubuf) / sizeof(jd_yuv_t); mcubuf[i++] = 128) ;
+    }
 
     bayer = (bayer + 1) & 7;
 
     mx = msx * 8; my = msy * 8;			/* Size of the MCU (pixel) */
-    uint16_t lasty = ((height - 1) / my) * my;
+    uint16_t lasty = (vp.bottom / my) * my;	/* Stop decoding after the last visible row */
 
     dcv[2] = dcv[1] = dcv[0] = 0;	/* Initialize DC values */
     rst = rsc = 0;
 
     rc = TJpgD::JDR_OK;
-    for (y = 0; y < height; y += my) {		/* Vertical loop of MCUs */
+    for (y = 0; y <= lasty; y += my) {		/* Vertical loop of MCUs */
+        bool vrow = (y + my > vp.top);
         for (x = 0; x < width; x += mx) {	/* Horizontal loop of MCUs */
             if (nrst && rst++ == nrst) {	/* Process restart interval if enabled */
                 rc = restart(this, rsc++);
                 if (rc != TJpgD::JDR_OK) return rc;
                 rst = 1;
             }
+            if (!vrow || x + mx <= vp.left || x > vp.right) {	/* Out of the viewport */
+                rc = mcu_skip(this);
+                if (rc != TJpgD::JDR_OK) return rc;
+                continue;
+            }
             rc = mcu_load(this, mcubuf, (int32_t*)workbuf);		/* Load an MCU (decompress huffman coded stream and apply IDCT) */
             if (rc != TJpgD::JDR_OK) return rc;
             rc = mcu_output(this, mcubuf, (uint8_t*)workbuf, outfunc, x, y);	/* Output the MCU (color space conversion, scaling and output) */
             if (rc != TJpgD::JDR_OK) return rc;
         }
         if (linefunc && (yidx == lineskip || y == lasty)) {
-            linefunc(this, y - yidx * my, yidx * my + ((height < y + my) ? height - y : my));
+            uint_fast16_t ly = y - yidx * my, lh = yidx * my + ((height < y + my) ? height - y : my);
+            scale_lines(this, ly, lh);
+            linefunc(this, ly, lh);
             yidx = 0;
         } else {
             ++yidx;
@@ -909,69 +1428,184 @@ TJpgD::JRESULT TJpgD::decomp (
     return rc;
 }
 
-typedef struct {
-    jd_yuv_t* mcubuf = NULL;
-    uint_fast16_t x = 0;
-    uint_fast16_t y = 0;
-    uint_fast8_t h = 0;
-    volatile uint_fast8_t queue = false;
-} queue_t;
+/*-----------------------------------------------------------------------*/
+/* Multitask decompression                                               */
+/*-----------------------------------------------------------------------*/
+/*
+  The caller task decodes MCUs (huffman and IDCT) and task_output on the
+  other core converts and outputs them.
+  They are handed over with a single-producer / single-consumer ring.
+  The producer publishes an entry by head, and the consumer releases it
+  by tail after the output. (Each index is written by only one side)
+  The consumer sleeps on the task notification only while the ring is empty.
+
+  If the image on memory has the restart intervals that do not straddle
+  the MCU rows, both tasks decode them in parallel. (See decomp_restart)
+*/
+
+//static constexpr uint_fast8_t queue_max = 20;
+static constexpr uint_fast8_t queue_max = JD_MT_QUEUE;	/* Number of the ring entries */
+static constexpr size_t cache_line = 64;		/* Keep the indices written by each side on the different cache lines */
+
+enum : uint8_t { MT_MCU, MT_LINE, MT_SEGMENT, MT_QUIT };	/* Kind of the ring entry */
 
 typedef struct {
-    TJpgD* jd;
-    uint32_t (*outfunc)(TJpgD*, void*, TJpgD::JRECT*);
-    uint32_t (*linefunc)(TJpgD*,uint32_t,uint32_t);
-    QueueHandle_t sem;
-    TaskHandle_t task;
-} param_task_output;
+    jd_yuv_t mcubuf[384];
+    const uint8_t* seg;		/* Top of the restart interval (MT_SEGMENT) */
+    uint_fast16_t x, y;		/* MCU position or top line (MT_LINE) */
+    uint_fast16_t h;		/* Number of lines (MT_LINE) */
+    uint8_t kind;
+} entry_t;
+
+/* Context of the multitask decompression (One for each decompressor object) */
+struct TJpgD::multitask_t {
+    TJpgD* jd = NULL;
+    uint32_t (*outfunc)(TJpgD*, void*, TJpgD::JRECT*) = NULL;
+    uint32_t (*linefunc)(TJpgD*,uint32_t,uint32_t) = NULL;
+    volatile TaskHandle_t task = NULL;
+    entry_t ring[queue_max];
+    jd_yuv_t spare[384];	/* MCU buffer for the output by the producer itself */
+    uint32_t lseq = 0;		/* head after the last MT_LINE entry (producer only) */
+    TJpgDSession sub;		/* Bit stream state of the consumer (MT_SEGMENT, the tables are shared with jd) */
+    TJpgD::JRECT vp;		/* Viewport in the input image coordinates (MT_SEGMENT) */
+    std::atomic<uint8_t> error{TJpgD::JDR_OK};	/* Result of MT_SEGMENT (Written by the consumer) */
+
+    uint8_t pad0[cache_line];
+    std::atomic<uint32_t> head{0};	/* Written by the producer */
+    uint8_t pad1[cache_line - sizeof(std::atomic<uint32_t>)];
+    std::atomic<uint32_t> tail{0};	/* Written by the consumer */
+    std::atomic<bool> idle{false};	/* Consumer is waiting for the notification (Written by the consumer) */
+
+    /* Get the entry to write, NULL if the ring is full (Producer) */
+    entry_t* entry () {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        return (h - tail.load(std::memory_order_acquire) < queue_max) ? &ring[h % queue_max] : NULL;
+    }
+    /* Publish the entry and wake up the consumer if needed (Producer) */
+    void push () {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+        if (idle.load(std::memory_order_seq_cst)) xTaskNotifyGive(task);
+    }
+    /* Wait for a free entry (Producer) */
+    entry_t* wait_entry () {
+        entry_t* e = entry();
+        if (!e) {
+            TraceScope("ring_full");	/* The consumer is behind */
+            while (!(e = entry())) taskYIELD();
+        }
+        return e;
+    }
+};
 
-//static constexpr uint_fast8_t queue_max = 20;
-static constexpr uint_fast8_t queue_max = 24;
-static param_task_output param;
-static jd_yuv_t mcubufs[queue_max + 1][384];
-static queue_t qwrites[queue_max];
-static queue_t qline;
-static uint_fast8_t qidx = 0;
-static uint_fast8_t mcuidx = 0;
+/* Find the top of the next restart interval, NULL if not found */
+static const uint8_t* next_segment (
+    const uint8_t* p,		/* Top of the current restart interval */
+    const uint8_t* pend		/* End of the data */
+                                   )
+{
+    while (pend - p >= 2 && (p = (const uint8_t*)memchr(p, 0xFF, pend - p - 1)) != NULL) {
+        uint_fast8_t d = p[1];
+        if ((d & 0xF8) == 0xD0) return p + 2;	/* RSTn */
+        if (d != 0x00 && d != 0xFF) break;		/* Other marker (EOI) */
+        p += (d == 0xFF) ? 1 : 2;				/* Skip the stuffed byte, or the fill byte */
+    }
+    return NULL;
+}
+
+/* Decode a restart interval from its top */
+static TJpgD::JRESULT segment_decode (
+    TJpgD* jd,			/* Pointer to the decompressor object (Output) */
+    TJpgDSession* ss,	/* Session to decode the interval (The bit stream state is reset to seg) */
+    const uint8_t* seg,	/* Top of the restart interval */
+    jd_yuv_t* mcubuf,
+    uint8_t* workbuf,
+    uint32_t (*outfunc)(TJpgD*, void*, TJpgD::JRECT*),	/* RGB output function */
+    uint_fast16_t x,	/* Left of the first MCU */
+    uint_fast16_t y,	/* Top of the MCU row */
+    const TJpgD::JRECT& vp	/* Viewport in the input image coordinates */
+                                      )
+{
+    TJpgD::JRESULT rc = TJpgD::JDR_OK;
+    uint_fast16_t mx = jd->msx * 8;
+
+    ss->dptr = const_cast<uint8_t*>(seg) - 1;	/* Last read byte */
+    ss->dbit = 0; ss->dval = 0; ss->wreg = 0; ss->marker = 0;
+    ss->dcv[2] = ss->dcv[1] = ss->dcv[0] = 0;
+
+    for (uint_fast16_t n = jd->nrst; n && x <= vp.right; --n, x += mx) {	/* The rest of the interval is not visible */
+        if (x + mx <= vp.left) {
+            rc = mcu_skip(ss);
+        } else {
+            rc = mcu_load(ss, mcubuf, (int32_t*)workbuf);
+            if (rc == TJpgD::JDR_OK) rc = mcu_output(jd, mcubuf, workbuf, outfunc, x, y);
+        }
+        if (rc != TJpgD::JDR_OK) break;
+    }
+    return rc;
+}
 
 static void task_output(void* arg)
 {
     uint8_t workbuf[768];
-    param_task_output* p = (param_task_output*)arg;
-    queue_t* q;
+    TJpgD::multitask_t* p = (TJpgD::multitask_t*)arg;
+    bool busy = false;	/* For the trace of the busy period */
     //Serial.println("task_output start");
     for (;;) {
-        if (!xQueueReceive(p->sem, &q, portMAX_DELAY)) continue;
-        if (!q) break;
-        //Serial.printf("task work: X=%d,Y=%d\r\n",q->x,q->y);
-        if (q->h == 0) {
-            mcu_output(p->jd, q->mcubuf, workbuf, p->outfunc, q->x, q->y);
+        uint32_t t = p->tail.load(std::memory_order_relaxed);
+        if (t == p->head.load(std::memory_order_acquire)) {	/* Empty */
+            if (busy) { TraceEnd("output"); busy = false; }
+            p->idle.store(true, std::memory_order_seq_cst);
+            if (t == p->head.load(std::memory_order_seq_cst)) ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            p->idle.store(false, std::memory_order_relaxed);
+            continue;
+        }
+        entry_t* e = &p->ring[t % queue_max];
+        if (e->kind == MT_QUIT) break;
+        if (!busy) { TraceBegin("output"); busy = true; }
+        //Serial.printf("task work: X=%d,Y=%d\r\n",e->x,e->y);
+        if (e->kind == MT_MCU) {
+            mcu_output(p->jd, e->mcubuf, workbuf, p->outfunc, e->x, e->y);
+        } else if (e->kind == MT_SEGMENT) {
+            TraceScope("segment");
+            TJpgD::JRESULT rc = segment_decode(p->jd, &p->sub, e->seg, e->mcubuf, workbuf, p->outfunc, e->x, e->y, p->vp);
+            if (rc != TJpgD::JDR_OK) p->error.store(rc, std::memory_order_relaxed);
         } else {
-            p->linefunc(p->jd, q->y, q->h);
+            TraceScope("line");
+            p->linefunc(p->jd, e->y, e->h);
         }
-        q->queue = false;
+        p->tail.store(t + 1, std::memory_order_release);	/* Release the entry */
         //Serial.println("task work done");
     }
-    vQueueDelete(p->sem);
     //Serial.println("task_output end");
+    p->task = NULL;	/* Notify multitask_end */
     vTaskDelete(NULL);
 }
 
-void TJpgD::multitask_begin ()
+bool TJpgD::multitask_begin ()
 {
-    param.sem = xQueueCreate(queue_max + 1, sizeof(queue_t*));
-    xTaskCreatePinnedToCore(task_output, "task_output", 4096, &param, 1, &param.task, 0/*core0*/);
+    if (mt) return true;	/* Already started */
+
+    multitask_t* m = new (std::nothrow) multitask_t();
+    if (!m) return false;
+    TaskHandle_t task = NULL;
+    if (xTaskCreatePinnedToCore(task_output, "task_output", 4096, m, 1, &task, 0/*core0*/) != pdPASS) {
+        delete m;
+        return false;
+    }
+    m->task = task;
+    mt = m;
+    return true;
 }
 
 void TJpgD::multitask_end ()
 {
-    queue_t* q = NULL;
-#if 0
-    xQueueSend(param.sem, &q, 0);
-    vTaskDelay(10);
-#else
-    xQueueSend(param.sem, &q, portMAX_DELAY);
-#endif
+    if (!mt) return;
+
+    mt->wait_entry()->kind = MT_QUIT;
+    mt->push();
+    while (mt->task) vTaskDelay(1);	/* Wait for the end of task_output */
+    delete mt;
+    mt = NULL;
 }
 
 TJpgD::JRESULT TJpgD::decomp_multitask (
@@ -985,31 +1619,40 @@ TJpgD::JRESULT TJpgD::decomp_multitask (
     TJpgD::JRESULT rc;
     uint8_t workbuf[768];
     uint_fast16_t yidx = 0;
+    TJpgD::JRECT vp;
+
+    if (!mt) return decomp(outfunc, linefunc, lineskip);	/* multitask_begin is not called */
+    if (scale > 3 || !source_viewport(this, vp)) return TJpgD::JDR_PAR;
 
+    multitask_t* m = mt;
+    while (m->tail.load(std::memory_order_acquire) != m->head.load(std::memory_order_relaxed)) taskYIELD();	/* Wait for the previous image */
     if (comps_in_frame == 1) { /* Erase Cr/Cb for Grayscale */
-        jd_yuv_t* b = (jd_yuv_t*)mcubufs;
-        size_t end = sizeof(mcubufs) / sizeof(jd_yuv_t);
-        do { *b++ = 128; } while (--end);
+        for (size_t i = 0; i < queue_max; ++i) {
+            for (size_t j = 0; j < 384; m->ring[i].mcubuf[j++] = 128) ;
+        }
+        for (size_t j = 0; j < 384; m->spare[j++] = 128) ;
     }
 
     bayer = (bayer + 1) & 7;
 
-    param.jd = this;
-    param.outfunc = outfunc;
-    param.linefunc = linefunc;
-    queue_t* q = &qwrites[qidx];
-    queue_t* ql = &qline;
-    queue_t* qtmp = NULL;
+    m->jd = this;
+    m->outfunc = outfunc;
+    m->linefunc = linefunc;
+    m->lseq = m->head.load(std::memory_order_relaxed);
 
     mx = msx * 8; my = msy * 8;			/* Size of the MCU (pixel) */
+    if (nrst && infunc == mem_infunc && ((width + mx - 1) / mx) % nrst == 0) {
+        return decomp_restart(linefunc, lineskip, vp);	/* Restart intervals in each MCU row can be decoded in parallel */
+    }
 
     dcv[2] = dcv[1] = dcv[0] = 0;	/* Initialize DC values */
     rst = rsc = 0;
-    uint_fast16_t lasty = ((height - 1) / my) * my;
+    uint_fast16_t lasty = (vp.bottom / my) * my;	/* Stop decoding after the last visible row */
 
     rc = TJpgD::JDR_OK;
     y = 0;
     do {		/* Vertical loop of MCUs */
+        bool vrow = (y + my > vp.top);
         x = 0;
         do {	/* Horizontal loop of MCUs */
             if (nrst && rst++ == nrst) {	/* Process restart interval if enabled */
@@ -1017,43 +1660,132 @@ TJpgD::JRESULT TJpgD::decomp_multitask (
                 if (rc != TJpgD::JDR_OK) break;
                 rst = 1;
             }
-            rc = mcu_load(this, mcubufs[mcuidx], (int32_t*)workbuf);
-            if (rc != TJpgD::JDR_OK) break;
-            if (!q->queue) {
-                //mcubufs[mcuidx][0] = 0;
-                //mcubufs[mcuidx][1] = 0;
-                q->mcubuf  = mcubufs[mcuidx];
-                q->x = x;
-                q->y = y;
-                q->queue = true;
-                xQueueSend(param.sem, &q, 0);
-                mcuidx = (1 + mcuidx) % (queue_max + 1);
-                qidx = (1 + qidx) % queue_max;
-                q = &qwrites[qidx];
-            } else {
-                while (ql->queue) taskYIELD();
-                //mcubufs[mcuidx][0] = 0xFF;
-                //mcubufs[mcuidx][1] = 0xFF;
-                rc = mcu_output(this, mcubufs[mcuidx], workbuf, outfunc, x, y);
+            if (!vrow || x + mx <= vp.left || x > vp.right) {	/* Out of the viewport */
+                rc = mcu_skip(this);
+                continue;
+            }
+            entry_t* e = m->entry();
+            if (!e && (int32_t)(m->tail.load(std::memory_order_acquire) - m->lseq) < 0) {
+                e = m->wait_entry();	/* Previous lines are not output yet, so this MCU must follow them */
+            }
+            if (e) {
+                rc = mcu_load(this, e->mcubuf, (int32_t*)workbuf);
+                if (rc != TJpgD::JDR_OK) break;
+                e->x = x;
+                e->y = y;
+                e->kind = MT_MCU;
+                m->push();
+            } else {	/* The ring is full, output by myself */
+                rc = mcu_load(this, m->spare, (int32_t*)workbuf);
+                if (rc != TJpgD::JDR_OK) break;
+                rc = mcu_output(this, m->spare, workbuf, outfunc, x, y);
             }
         } while ((x += mx) < width && rc == TJpgD::JDR_OK);
         if (rc != TJpgD::JDR_OK) { break; }
         if (linefunc && (yidx == lineskip || y == lasty)) {
-            while (ql->queue) taskYIELD();
-            while (xQueueReceive(param.sem, &qtmp, 0)) {
-                //qtmp->mcubuf[0] = 0xFF;
-                //qtmp->mcubuf[1] = 0xFF;
-                rc = mcu_output(this, qtmp->mcubuf, workbuf, outfunc, qtmp->x, qtmp->y);
-                qtmp->queue = false;
+            uint_fast16_t ly = y - yidx * my, lh = yidx * my + ((height < y + my) ? height - y : my);
+            scale_lines(this, ly, lh);
+            entry_t* e = m->wait_entry();
+            e->y = ly;
+            e->h = lh;
+            e->kind = MT_LINE;
+            m->push();
+            m->lseq = m->head.load(std::memory_order_relaxed);
+            yidx = 0;
+        } else {
+            ++yidx;
+        }
+    } while ((y += my) <= lasty);
+    return rc;
+}
+
+/*
+  Restart interval parallel decompression
+  Each restart interval begins with the reset DC values and the byte aligned
+  bit stream, so it can be decoded independently of the others.
+  The caller finds the top of each interval by scanning the RSTn markers,
+  and hands every second visible interval in a band to task_output.
+  Both tasks decode and output their own intervals. (Disjoint rectangles)
+  The caller starts the next band after task_output finished the previous
+  one and its MT_LINE, so the band buffer of linefunc is not overwritten.
+*/
+TJpgD::JRESULT TJpgD::decomp_restart (
+    uint32_t (*linefunc)(TJpgD*,uint32_t,uint32_t),
+    uint32_t lineskip,						/* linefunc skip number */
+    const TJpgD::JRECT& vp					/* Viewport in the input image coordinates */
+                                      )
+{
+    uint_fast16_t x, y, mx, my, span;
+    TJpgD::JRESULT rc;
+    uint8_t workbuf[768];
+    uint_fast16_t yidx = 0;
+    multitask_t* m = mt;
+    const uint8_t* seg = dptr + 1;	/* Top of the first restart interval */
+    const uint8_t* own = NULL;		/* Restart interval decoded by the caller */
+    uint_fast16_t ox = 0, oy = 0;
+
+    m->sub = *this;	/* Session of the consumer (The work memory is not copied) */
+    m->vp = vp;
+    m->error.store(TJpgD::JDR_OK, std::memory_order_relaxed);
+
+    mx = msx * 8; my = msy * 8;			/* Size of the MCU (pixel) */
+    span = nrst * mx;					/* Width of the restart interval (pixel) */
+    uint_fast16_t lasty = (vp.bottom / my) * my;	/* Stop decoding after the last visible row */
+
+    rc = TJpgD::JDR_OK;
+    y = 0;
+    do {		/* Vertical loop of MCUs */
+        if (yidx == 0) {	/* Top of the band, wait for the output of the previous band */
+            while ((int32_t)(m->tail.load(std::memory_order_acquire) - m->lseq) < 0) taskYIELD();
+            rc = (TJpgD::JRESULT)m->error.load(std::memory_order_relaxed);
+            if (rc != TJpgD::JDR_OK) break;
+        }
+        bool vrow = (y + my > vp.top);
+        for (x = 0; x < width; x += span) {	/* Horizontal loop of restart intervals */
+            if (x || y) {
+                seg = next_segment(seg, dpend);
+                if (!seg) { rc = TJpgD::JDR_FMT1; break; }	/* Err: expected RSTn marker is not detected */
+            }
+            if (!vrow || x + span <= vp.left || x > vp.right) continue;	/* Out of the viewport */
+            if (!own) {
+                own = seg; ox = x; oy = y;
+                continue;
+            }
+            entry_t* e = m->wait_entry();
+            e->seg = seg;
+            e->x = x;
+            e->y = y;
+            e->kind = MT_SEGMENT;
+            m->push();
+            rc = segment_decode(this, this, own, m->spare, workbuf, m->outfunc, ox, oy, vp);
+            own = NULL;
+            if (rc != TJpgD::JDR_OK) break;
+        }
+        if (rc != TJpgD::JDR_OK) { break; }
+        if (yidx == lineskip || y == lasty) {	/* Bottom of the band */
+            if (own) {
+                rc = segment_decode(this, this, own, m->spare, workbuf, m->outfunc, ox, oy, vp);
+                own = NULL;
+                if (rc != TJpgD::JDR_OK) break;
+            }
+            if (linefunc) {
+                uint_fast16_t ly = y - yidx * my, lh = yidx * my + ((height < y + my) ? height - y : my);
+                scale_lines(this, ly, lh);
+                entry_t* e = m->wait_entry();
+                e->y = ly;
+                e->h = lh;
+                e->kind = MT_LINE;
+                m->push();
+                m->lseq = m->head.load(std::memory_order_relaxed);
             }
-            ql->h = (y == lasty) ? (yidx * my + height - y) : ((lineskip + 1) * my);
-            ql->y = y - yidx * my;
-            ql->queue = true;
-            xQueueSend(param.sem, &ql, 0);
             yidx = 0;
         } else {
             ++yidx;
         }
-    } while ((y += my) < height);
+    } while ((y += my) <= lasty);
+
+    /* Wait for the intervals of task_output to get the result */
+    while (m->tail.load(std::memory_order_acquire) != m->head.load(std::memory_order_relaxed)) taskYIELD();
+    if (rc == TJpgD::JDR_OK) rc = (TJpgD::JRESULT)m->error.load(std::memory_order_relaxed);
     return rc;
 }
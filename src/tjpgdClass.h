@@ -14,6 +14,26 @@
 //#define JD_FORMAT		0	/* Output pixel format 0:RGB888 (3 BYTE/pix), 1:RGB565 (1 WORD/pix) */
 #define JD_TBLCLIP		1	/* Use table for saturation (might be a bit faster but increases 1K bytes of code size) */
 #define JD_FASTDECODE   1
+#define JD_FASTHUFF		1	/* Use lookup table for huffman decoding and 32-bit bit buffer (increases 4K bytes of work memory) */
+#define HUFF_BIT		9	/* Bit length of the huffman lookup table (JD_FASTHUFF) */
+#ifndef JD_FIXEDCOLOR
+#define JD_FIXEDCOLOR	1	/* Use fixed-point instead of float for YCbCr to RGB conversion */
+#endif
+#ifndef JD_MT_QUEUE
+#define JD_MT_QUEUE		24	/* Number of the ring entries of decomp_multitask (Each has an MCU buffer, 768 bytes) */
+#endif
+#ifndef JD_IDCTDISPATCH
+#define JD_IDCTDISPATCH	1	/* Choose the IDCT by the last non-zero element (0: block_idct<8> for all the blocks, for the comparison) */
+#endif
+#ifndef JD_COSTCOUNT
+#define JD_COSTCOUNT	0	/* Count the decoding work into TJpgD::cost (for the host tools, decomp only) */
+#endif
+
+#if JD_FASTHUFF
+#define TJPGD_SZPOOL	(3900 + 4 * (2 << HUFF_BIT))	/* Size of work memory pool in each object (+ Huffman lookup tables) */
+#else
+#define TJPGD_SZPOOL	3900	/* Size of work memory pool in each object */
+#endif
 
 /*---------------------------------------------------------------------------*/
 #include <cstdint>
@@ -26,7 +46,9 @@ typedef uint8_t jd_yuv_t;
 
 /* Decompressor object structure */
 typedef struct TJpgD TJpgD;
-struct TJpgD {
+
+/* Session of the decompression (Stream, tables and output settings, without the work memory) */
+struct TJpgDSession {
     /* Error code */
     typedef enum {
         JDR_OK = 0,	/* 0: Succeeded */
@@ -40,6 +62,12 @@ struct TJpgD {
         JDR_FMT3	/* 8: Not supported JPEG standard */
     } JRESULT;
 
+    /* Output pixel format */
+    typedef enum {
+        JDF_RGB888 = 0,	/* 0: RGB888 (3 BYTE/pix) */
+        JDF_SWAP565		/* 1: Byte swapped RGB565 (1 WORD/pix) for the panel */
+    } JFORMAT;
+
     /* Rectangular structure */
     typedef struct {
         int_fast16_t left, right, top, bottom;
@@ -49,7 +77,12 @@ struct TJpgD {
     uint8_t* dpend;				/* data end ptr */
     uint8_t* inbuf;				/* Bit stream input buffer */
     uint8_t dbit;				/* Current bit in the current read byte */
+    uint8_t dval;				/* Value of the current read byte (0xFF if the byte is stuffed 0x00) */
+    uint8_t marker;				/* Detected marker (JD_FASTHUFF) */
+    uint32_t wreg;				/* Bit buffer, dbit is the number of available bits (JD_FASTHUFF) */
     uint8_t bayer;				/* Output bayer gain */
+    uint8_t format;				/* Output pixel format (JFORMAT) */
+    uint8_t scale;				/* Output scaling ratio 0:1/1, 1:1/2, 2:1/4, 3:1/8 (Kept over prepare) */
     uint8_t msx, msy;			/* MCU size in unit of block (width, height) */
     uint8_t qtid[3];			/* Quantization table ID of each component */
     int16_t dcv[3];				/* Previous DC element of each component */
@@ -58,17 +91,50 @@ struct TJpgD {
     uint8_t* huffbits[2][2];	/* Huffman bit distribution tables [id][dcac] */
     uint16_t* huffcode[2][2];	/* Huffman code word tables [id][dcac] */
     uint8_t* huffdata[2][2];	/* Huffman decoded data tables [id][dcac] */
+    uint16_t* hufflut[2][2];	/* Huffman lookup tables [id][dcac] (JD_FASTHUFF) */
     int32_t* qttbl[4];			/* Dequantizer tables [id] */
     void* pool;					/* Pointer to available memory pool */
     uint16_t sz_pool;			/* Size of momory pool (bytes available) */
     uint32_t (*infunc)(TJpgD*, uint8_t*, uint32_t);/* Pointer to jpeg stream input function */
     void* device;				/* Pointer to I/O device identifiler for the session */
     uint8_t comps_in_frame;		/* 1=Y(grayscale)  3=YCrCb */
+    JRECT viewport;				/* Visible area of the output image, MCUs out of it are only entropy decoded (Reset by prepare) */
+#if JD_COSTCOUNT
+    struct {
+        uint32_t symbols;		/* Huffman decoded symbols (DC, AC and EOB) */
+        uint32_t nonzero;		/* Non-zero AC elements */
+        uint32_t blocks;		/* Decoded blocks (Skipped MCUs are not included) */
+        uint32_t idct8, idct4;	/* Blocks by block_idct<8> and block_idct<4> (The others are DC only or reduced) */
+    } cost;						/* Decoding work (Reset by prepare) */
+#endif
+    TJpgD* owner;				/* Decompressor object of the session (Passed to infunc) */
+};
 
+struct TJpgD : TJpgDSession {
     JRESULT prepare (uint32_t(*)(TJpgD*,uint8_t*,uint32_t), void*);
+    JRESULT prepare (const uint8_t*, uint32_t, void*);	/* Memory source (zero-copy input) */
+    /* Size of the output image (scaled) */
+    int32_t scaled_width () const { return (width + (1 << scale) - 1) >> scale; }
+    int32_t scaled_height () const { return (height + (1 << scale) - 1) >> scale; }
+    /* Set the visible area in the output (scaled) image coordinates */
+    void set_viewport (int32_t x, int32_t y, int32_t w, int32_t h) {
+        viewport.left = (x < 0) ? 0 : x; viewport.right = x + w - 1;
+        viewport.top = (y < 0) ? 0 : y; viewport.bottom = y + h - 1;
+    }
+
     JRESULT decomp (uint32_t(*)(TJpgD*,void*,JRECT*), uint32_t(*)(TJpgD*,uint32_t,uint32_t) = 0, uint32_t = 0);
     JRESULT decomp_multitask (uint32_t(*)(TJpgD*,void*,JRECT*), uint32_t(*)(TJpgD*,uint32_t,uint32_t) = 0, uint32_t = 0);
-    static void multitask_begin ();
-    static void multitask_end ();
+    /* Create / delete the output task and the buffers for decomp_multitask (for each object) */
+    bool multitask_begin ();
+    void multitask_end ();
+
+    struct multitask_t;
+    multitask_t* mt;			/* Context of decomp_multitask (Created by multitask_begin) */
+    alignas(4) uint8_t workpool[TJPGD_SZPOOL];	/* Work memory pool (Not shared with other objects) */
+
+private:
+    void init_session (uint32_t(*)(TJpgD*,uint8_t*,uint32_t), void*);
+    JRESULT analyze (uint32_t);
+    JRESULT decomp_restart (uint32_t(*)(TJpgD*,uint32_t,uint32_t), uint32_t, const JRECT&);
 };
 #endif /* _TJPGDEC */